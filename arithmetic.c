@@ -39,6 +39,12 @@ int range_calc_new_range(range_coder *c,
 			 unsigned int p_low, unsigned int p_high,
 			 unsigned int *new_low,unsigned int *new_high);
 int range_emitbit(range_coder *c,int b);
+int range_byte_encode(range_coder *c,unsigned int p_low,unsigned int p_high);
+int range_byte_decode_common(range_coder *c,unsigned int p_low,unsigned int p_high);
+unsigned int range_byte_target(range_coder *c);
+int range_decode_target(range_coder *c,unsigned int *target);
+int range_byte_conclude(range_coder *c);
+int range_byte_prefetch(range_coder *c);
 
 int bits2bytes(int b)
 {
@@ -78,8 +84,8 @@ int range_decode_getnextbit(range_coder *c)
 int range_emitbit(range_coder *c,int b)
 {
   if (c->bits_used>=(c->bit_stream_length)) {
-    printf("out of bits\n");
-    exit(-1);
+    if (c->debug) printf("%s: out of bits\n",c->debug);
+    c->errors++;
     return -1;
   }
   int bit=(c->bits_used&7)^7;
@@ -92,7 +98,7 @@ int range_emitbit(range_coder *c,int b)
 
 int range_emit_stable_bits(range_coder *c)
 {
-  range_check(c,__LINE__);
+  if (range_check(c,__LINE__)) return -1;
   /* look for actually stable bits, i.e.,msb of low and high match */
   while (!((c->low^c->high)&0x80000000))
     {
@@ -124,12 +130,12 @@ int range_emit_stable_bits(range_coder *c)
 	c->value|=nextbit;
 	// printf("value became 0x%08x (low=0x%08x, high=0x%08x), nextbit=%d\n",c->value,c->low,c->high,nextbit);
       }
-      range_check(c,__LINE__);
+      if (range_check(c,__LINE__)) return -1;
     }
 
   /* Now see if we have underflow, and need to count the number of underflowed
      bits. */
-  if (!c->norescale) range_rescale(c);
+  if (!c->norescale) if (range_rescale(c)) return -1;
 
   return 0;
 }
@@ -158,7 +164,8 @@ int range_rescale(range_coder *c) {
       new_high|=0x80000000;
       if (new_low>=new_high) { 
 	fprintf(stderr,"oops\n");
-	exit(-1);
+	c->errors++;
+	return -1;
       }
       if (c->debug)
 	printf("%s: rescaling: old=[0x%08x,0x%08x], new=[0x%08x,0x%08x]\n",
@@ -226,6 +233,260 @@ int range_emitbits(range_coder *c,int n)
 }
 
 
+/* Byte-oriented coder.
+
+   Instead of shifting out one stable bit at a time and counting underflow
+   bits, the byte-oriented coder keeps a 56-bit low and range, and shifts
+   out a whole byte whenever the range falls below 2^48.  Carries out of
+   low are propagated into the output using a cached byte plus a count of
+   pending 0xff bytes, which is the same trick LZMA's range coder uses.
+   The range never falls below 2^48 before a symbol is coded, so there are
+   always at least 24 bits of precision for the 24-bit probabilities.
+*/
+#define WIDE_TOP (1ULL<<56)
+#define WIDE_MASK (WIDE_TOP-1)
+#define WIDE_BOTTOM (1ULL<<48)
+
+int range_emitbyte(range_coder *c,int b)
+{
+  if (c->bits_used+8>(c->bit_stream_length)) {
+    if (c->debug) printf("%s: out of bits\n",c->debug);
+    c->errors++;
+    return -1;
+  }
+  c->bit_stream[c->bits_used>>3]=b;
+  c->bits_used+=8;
+  return 0;
+}
+
+int range_byte_shift_low(range_coder *c)
+{
+  /* The first byte out never has a cached byte in front of it, and
+     cannot receive a carry, as the whole stream lies in [0,2^56). */
+  if ((!c->wide_cache_size)
+      ||(c->wide_low<0xff000000000000ULL)||(c->wide_low>=WIDE_TOP)) {
+    int carry=c->wide_low>>56;
+    if (c->wide_cache_size) {
+      if (range_emitbyte(c,c->wide_cache+carry)) return -1;
+      while(--c->wide_cache_size)
+	if (range_emitbyte(c,0xff+carry)) return -1;
+    }
+    c->wide_cache=(c->wide_low>>48)&0xff;
+  }
+  c->wide_cache_size++;
+  c->wide_low=(c->wide_low<<8)&WIDE_MASK;
+  return 0;
+}
+
+int range_byte_encode(range_coder *c,unsigned int p_low,unsigned int p_high)
+{
+  if (p_high<=p_low) {
+    c->errors++;
+    return -1;
+  }
+  unsigned long long r=c->wide_range>>SIGNIFICANTBITS;
+  c->wide_low+=r*p_low;
+  /* The last symbol soaks up the slack left by truncating r */
+  if (p_high>=MAXVALUEPLUS1) c->wide_range-=r*p_low;
+  else c->wide_range=r*(p_high-p_low);
+  while(c->wide_range<WIDE_BOTTOM) {
+    c->wide_range<<=8;
+    if (range_byte_shift_low(c)) return -1;
+  }
+  return 0;
+}
+
+/* Position of the code value within the current range, scaled to the 24-bit
+   probability space. */
+unsigned int range_byte_target(range_coder *c)
+{
+  unsigned long long target=c->wide_low/(c->wide_range>>SIGNIFICANTBITS);
+  if (target>MAXVALUE) target=MAXVALUE;
+  return target;
+}
+
+int range_byte_nextbyte(range_coder *c)
+{
+  /* return 0s once we have used all bytes */
+  if (c->bit_stream_length<=c->bits_used) {
+    c->bits_used+=8;
+    return 0;
+  }
+  int b=c->bit_stream[c->bits_used>>3];
+  c->bits_used+=8;
+  return b;
+}
+
+int range_byte_decode_common(range_coder *c,unsigned int p_low,unsigned int p_high)
+{
+  if (p_high<=p_low) return -1;
+  unsigned long long r=c->wide_range>>SIGNIFICANTBITS;
+  unsigned long long base=r*p_low;
+  if (c->wide_low<base) return -1;
+  unsigned long long new_range;
+  if (p_high>=MAXVALUEPLUS1) new_range=c->wide_range-base;
+  else new_range=r*(p_high-p_low);
+  if (c->wide_low-base>=new_range) return -1;
+
+  c->wide_low-=base;
+  c->wide_range=new_range;
+  while(c->wide_range<WIDE_BOTTOM) {
+    c->wide_range<<=8;
+    c->wide_low=(c->wide_low<<8)|range_byte_nextbyte(c);
+  }
+  return 0;
+}
+
+int range_byte_conclude(range_coder *c)
+{
+  /* Pick the value in [low,low+range) with the most trailing zero bytes,
+     since the decoder reads zeros once it runs off the end of the stream. */
+  int bytes;
+  for(bytes=0;bytes<7;bytes++) {
+    unsigned long long mask=WIDE_MASK>>(bytes*8);
+    unsigned long long v=(c->wide_low+mask)&~mask;
+    if (v-c->wide_low<c->wide_range) {
+      c->wide_low=v;
+      break;
+    }
+  }
+  /* Shift out the significant bytes, plus one more to flush the cache */
+  int i;
+  for(i=0;i<=bytes;i++)
+    if (range_byte_shift_low(c)) return -1;
+  while(c->bits_used&&!c->bit_stream[(c->bits_used>>3)-1]) c->bits_used-=8;
+  c->wide_range=WIDE_MASK;
+  return 0;
+}
+
+int range_byte_prefetch(range_coder *c)
+{
+  int i;
+  c->wide_low=0;
+  c->wide_range=WIDE_MASK;
+  for(i=0;i<7;i++)
+    c->wide_low=(c->wide_low<<8)|range_byte_nextbyte(c);
+  return 0;
+}
+
+/* Interleaved rANS coder.
+
+   Each state x lies in [2^24,2^32).  Coding a symbol whose probability
+   range is [p_low,p_high) out of 2^24 maps x to ((x/f)<<24)+(x%f)+p_low,
+   where f=p_high-p_low, after first shifting out low bytes of x until
+   x/f<256, so that the result still fits in 32 bits.  The decoder finds
+   the symbol from the bottom 24 bits of the state, and reverses the
+   mapping with a single multiply, so it never has to divide.
+
+   The decoder must read the bytes in the opposite order to which the
+   encoder produces them, so symbols are queued while encoding and
+   range_conclude() codes them from last to first, writing downwards from
+   the end of the buffer before moving the result into place.
+   Symbol i uses state i%RANS_STATES, so the update of one state does not
+   have to wait for the previous symbol's.  The states are written out
+   first, so that the decoder can load them straight away.
+*/
+#define RANS_L (1U<<SIGNIFICANTBITS)
+#define RANS_STATE_BYTES 4
+
+int range_rans_queue(range_coder *c,unsigned int p_low,unsigned int p_high)
+{
+  if (p_high<=p_low) {
+    c->errors++;
+    return -1;
+  }
+  if (c->rans_pending_count>=c->rans_pending_size) {
+    int size=c->rans_pending_size?c->rans_pending_size*2:1024;
+    unsigned int *p=realloc(c->rans_pending,size*2*sizeof(unsigned int));
+    if (!p) {
+      fprintf(stderr,"Could not grow rANS symbol queue to %d symbols\n",size);
+      c->errors++;
+      return -1;
+    }
+    c->rans_pending=p;
+    c->rans_pending_size=size;
+  }
+  c->rans_pending[c->rans_pending_count*2]=p_low;
+  c->rans_pending[c->rans_pending_count*2+1]=p_high;
+  c->rans_pending_count++;
+  return 0;
+}
+
+int range_rans_conclude(range_coder *c)
+{
+  if (!c->rans_pending_count) return 0;
+
+  unsigned char *first=&c->bit_stream[(c->bits_used+7)>>3];
+  unsigned char *out=&c->bit_stream[c->bit_stream_length>>3];
+  unsigned int x[RANS_STATES];
+  int i,j;
+
+  for(i=0;i<RANS_STATES;i++) x[i]=RANS_L;
+  for(i=c->rans_pending_count-1;i>=0;i--) {
+    unsigned int p_low=c->rans_pending[i*2];
+    unsigned int f=c->rans_pending[i*2+1]-p_low;
+    unsigned int *s=&x[i%RANS_STATES];
+    while((*s>>8)>=f) {
+      if (out<=first) goto full;
+      *--out=*s;
+      *s>>=8;
+    }
+    *s=((*s/f)<<SIGNIFICANTBITS)+(*s%f)+p_low;
+  }
+  for(i=RANS_STATES-1;i>=0;i--)
+    for(j=0;j<RANS_STATE_BYTES;j++) {
+      if (out<=first) goto full;
+      *--out=x[i]>>(j*8);
+    }
+
+  int bytes=&c->bit_stream[c->bit_stream_length>>3]-out;
+  bcopy(out,first,bytes);
+  c->bits_used=(first-c->bit_stream+bytes)*8;
+  /* The decoder reads zeros once it runs off the end of the stream */
+  while(bytes--&&!first[bytes]) c->bits_used-=8;
+  c->rans_pending_count=0;
+  return 0;
+
+ full:
+  if (c->debug) printf("%s: out of bits\n",c->debug);
+  c->errors++;
+  return -1;
+}
+
+int range_rans_prefetch(range_coder *c)
+{
+  int i,j;
+  for(i=0;i<RANS_STATES;i++) {
+    c->rans_state[i]=0;
+    for(j=0;j<RANS_STATE_BYTES;j++)
+      c->rans_state[i]=(c->rans_state[i]<<8)|range_byte_nextbyte(c);
+  }
+  c->rans_next=0;
+  return 0;
+}
+
+unsigned int range_rans_target(range_coder *c)
+{
+  return (c->rans_state[c->rans_next]&MAXVALUE)+1;
+}
+
+int range_rans_decode_common(range_coder *c,unsigned int p_low,unsigned int p_high)
+{
+  unsigned int x=c->rans_state[c->rans_next];
+  unsigned int slot=x&MAXVALUE;
+  if (slot<p_low||slot>=p_high) return -1;
+  x=(p_high-p_low)*(x>>SIGNIFICANTBITS)+slot-p_low;
+  while(x<RANS_L) {
+    /* Only a corrupt stream can get here, and no amount of reading
+       would bring it back into range */
+    if (!x) return -1;
+    x=(x<<8)|range_byte_nextbyte(c);
+  }
+  c->rans_state[c->rans_next]=x;
+  c->rans_next=(c->rans_next+1)%RANS_STATES;
+  return 0;
+}
+
 char bitstring[33];
 char *asbits(unsigned int v)
 {
@@ -241,17 +502,62 @@ unsigned long long range_space(range_coder *c)
   return ((unsigned long long)c->high-(unsigned long long)c->low)&0xffffff00;
 }
 
+/* log2(1+i/256) in 16.16 fixed point, for i=0..256.  It is filled in
+   as the program starts, so that concurrent encoders never race to. */
+int log2_table[257];
+
+void __attribute__((constructor)) range_log2_init()
+{
+  int i;
+  for(i=0;i<=256;i++) log2_table[i]=log(1.0+i/256.0)/log(2)*65536.0+0.5;
+}
+
+/* log2(v) in 16.16 fixed point, for v>0.  The top 8 bits of the mantissa
+   index the table, and the next 8 bits interpolate linearly between
+   entries, which is good to about 1/50000 of a bit. */
+int range_log2_fixed(unsigned int v)
+{
+  int n=31-__builtin_clz(v);
+  unsigned int m=v<<(31-n);
+  int i=(m>>23)&0xff;
+  int f=(m>>15)&0xff;
+  return (n<<16)+log2_table[i]+(((log2_table[i+1]-log2_table[i])*f)>>8);
+}
+
+int range_account_entropy(range_coder *c,unsigned int p_low,unsigned int p_high)
+{
+  if (c->noentropy||p_high<=p_low) return 0;
+  /* -log2((p_high-p_low)/2^24) */
+  int this_entropy=(SIGNIFICANTBITS<<16)-range_log2_fixed(p_high-p_low);
+  if (0)
+    printf("%s: entropy of range p_low=0x%x, p_high=0x%x = %f\n",
+	   c->debug,p_low,p_high,this_entropy/65536.0);
+  c->entropy+=this_entropy/65536.0;
+  return 0;
+}
+
 int range_encode(range_coder *c,unsigned int p_low,unsigned int p_high)
 {
   if (p_low>p_high) {
     fprintf(stderr,"range_encode() called with p_low>p_high: p_low=%u, p_high=%u\n",
 	    p_low,p_high);
-    exit(-1);
+    c->errors++;
+    return -1;
   }
   if (p_low>MAXVALUE||p_high>MAXVALUEPLUS1) {
     fprintf(stderr,"range_encode() called with p_low or p_high >=0x%x: p_low=0x%x, p_high=0x%x\n",
 	    MAXVALUE,p_low,p_high);
-    exit(-1);
+    c->errors++;
+    return -1;
+  }
+
+  if (c->format==RANGE_FORMAT_BYTEWISE) {
+    range_account_entropy(c,p_low,p_high);
+    return range_byte_encode(c,p_low,p_high);
+  }
+  if (c->format==RANGE_FORMAT_RANS) {
+    range_account_entropy(c,p_low,p_high);
+    return range_rans_queue(c,p_low,p_high);
   }
 
   unsigned int new_low,new_high;
@@ -261,33 +567,22 @@ int range_encode(range_coder *c,unsigned int p_low,unsigned int p_high)
   if (range_calc_new_range(c,p_low,p_high,&new_low,&new_high))
     {
       fprintf(stderr,"range_calc_new_range() failed.\n");
-      exit(-1);
+      c->errors++;
+      return -1;
     }
   
-  range_check(c,__LINE__);
+  if (range_check(c,__LINE__)) return -1;
   c->low=new_low;
   c->high=new_high;
-  range_check(c,__LINE__);
+  if (range_check(c,__LINE__)) return -1;
 
   if (c->debug) {
     printf("%s: space=0x%08llx[%s], new_low=0x%08x, new_high=0x%08x\n",
 	   c->debug,range_space(c),asbits(range_space(c)),new_low,new_high);
   }
 
-  unsigned long long p_diff=p_high-p_low;
-  unsigned long long p_range=(unsigned long long)p_diff<<(long long)SHIFTUPBITS;
-  double p=((double)p_range)/(double)0x100000000LL;
-  double this_entropy=-log(p)/log(2);
-  if (0)
-    printf("%s: entropy of range 0x%llx(p_low=0x%x, p_high=0x%x, p_diff=0x%llx) = %f, shiftupbits=%lld\n",
-	   c->debug,p_range,p_low,p_high,p_diff,this_entropy,SHIFTUPBITS);
-  if (this_entropy<0) {
-    fprintf(stderr,"entropy of symbol is negative! (p=%f, e=%f)\n",p,this_entropy);
-    exit(-1);
-  }
-  c->entropy+=this_entropy;
+  range_account_entropy(c,p_low,p_high);
 
-  range_check(c,__LINE__);
   if (range_emit_stable_bits(c)) return -1;
 
   if (c->debug) {
@@ -299,11 +594,49 @@ int range_encode(range_coder *c,unsigned int p_low,unsigned int p_high)
   return 0;
 }
 
+/* Equiprobable boundaries are floor(symbol*MAXVALUE/alphabet_size).
+   For the small alphabets that make up most calls (digits, bytes, 
+   printable characters, interpolative coding of message positions) we
+   split MAXVALUE into quotient and remainder by the alphabet size, and
+   divide the remainder part, which is below alphabet_size^2, by 
+   multiplying by a reciprocal with RECIPROCAL_SHIFT bits of precision.
+   That is exact for any numerator below 2^(RECIPROCAL_SHIFT-10). */
+#define RECIPROCAL_LIMIT 1024
+#define RECIPROCAL_SHIFT 30
+struct range_reciprocal {
+  unsigned int quotient;
+  unsigned int remainder;
+  unsigned int multiplier;
+};
+/* Filled in by a constructor, like log2_table */
+struct range_reciprocal reciprocals[RECIPROCAL_LIMIT+1];
+
+void __attribute__((constructor)) range_reciprocal_init()
+{
+  int a;
+  for(a=1;a<=RECIPROCAL_LIMIT;a++) {
+    reciprocals[a].quotient=MAXVALUE/a;
+    reciprocals[a].remainder=MAXVALUE%a;
+    reciprocals[a].multiplier=(1LL<<RECIPROCAL_SHIFT)/a+1;
+  }
+}
+
+unsigned int range_equiprobable_boundary(int alphabet_size,int symbol)
+{
+  if (alphabet_size<=RECIPROCAL_LIMIT) {
+    struct range_reciprocal *r=&reciprocals[alphabet_size];
+    return symbol*r->quotient
+      +(((unsigned long long)(symbol*r->remainder)*r->multiplier)
+	>>RECIPROCAL_SHIFT);
+  }
+  return (((unsigned long long)symbol)*MAXVALUE)/alphabet_size;
+}
+
 int range_equiprobable_range(range_coder *c,int alphabet_size,int symbol,unsigned int *p_low,unsigned int *p_high)
 {
-  *p_low=(((unsigned long long)symbol)*0xffffff)/(unsigned long long)alphabet_size;
-  *p_high=(((1LL+(unsigned long long)symbol)*0xffffff)/(unsigned long long)alphabet_size);
-  if (symbol==alphabet_size-1) *p_high=0xffffff;
+  *p_low=range_equiprobable_boundary(alphabet_size,symbol);
+  /* for the last symbol this comes to exactly MAXVALUE */
+  *p_high=range_equiprobable_boundary(alphabet_size,symbol+1);
   return 0;
 }
 
@@ -311,15 +644,9 @@ int range_encode_equiprobable(range_coder *c,int alphabet_size,int symbol)
 {
   if (alphabet_size>=0x400000) {
     /* For bigger alphabet sizes, split it */
-    range_encode_equiprobable(c,1+(alphabet_size/0x10000),symbol/0x10000);
-    range_encode_equiprobable(c,0x10000,symbol&0xffff);
-    return 0;
-  }
-
-  if (alphabet_size>=0x400000) {
-    fprintf(stderr,"%s() passed alphabet_size>0x400000\n",__FUNCTION__);
-    c->errors++;
-    exit(-1);
+    if (range_encode_equiprobable(c,1+(alphabet_size/0x10000),symbol/0x10000))
+      return -1;
+    return range_encode_equiprobable(c,0x10000,symbol&0xffff);
   }
   if (alphabet_size<1) return 0;
 
@@ -335,52 +662,41 @@ int range_encode_equiprobable(range_coder *c,int alphabet_size,int symbol)
 int range_decode_equiprobable(range_coder *c,int alphabet_size)
 {  
   if (alphabet_size>=0x400000) {
-    unsigned int high=range_decode_equiprobable(c,1+(alphabet_size/0x10000));
-    unsigned int low=range_decode_equiprobable(c,0x10000);
+    int high=range_decode_equiprobable(c,1+(alphabet_size/0x10000));
+    if (high<0) return -1;
+    int low=range_decode_equiprobable(c,0x10000);
+    if (low<0) return -1;
     return low|(high<<16);
   }
 
   if (alphabet_size<1) return 0;
-  unsigned long long space=range_space(c);
-  unsigned long long v=c->value-c->low;
-  // unsigned long long p=0xffffff*v/space;
-  unsigned int s=v*alphabet_size/space;
-  
-  if (c->debug)
-    fprintf(stderr,"decoding: alphabet size = %d, estimating s=%d (0x%x)\n",
-	    alphabet_size,s,s);
-
-  int symbol;
 
-  for(symbol=s?s-1:0;symbol<s+2&&symbol<alphabet_size;symbol++)
-    {
-      unsigned int p_low,p_high;
-      range_equiprobable_range(c,alphabet_size,symbol,&p_low,&p_high);
-      if (!range_decode_common(c,p_low,p_high,symbol)) {
-	if (c->debug) 
-	  fprintf(stderr,"Decoding %d/%d p_low=0x%x, p_high=0x%x\n",
-		  symbol,alphabet_size,p_low,p_high);
-	return symbol;     
-      }
-    }
+  /* Symbol s covers targets in (floor(s*MAXVALUE/alphabet_size),
+     floor((s+1)*MAXVALUE/alphabet_size)], so the symbol containing
+     target t is the largest s with s*MAXVALUE < t*alphabet_size. */
+  unsigned int t;
+  if (range_decode_target(c,&t)) return -1;
+  unsigned long long target=t;
+  int symbol=0;
+  if (target) symbol=(target*alphabet_size-1)/MAXVALUE;
+  if (symbol>=alphabet_size) symbol=alphabet_size-1;
 
-  fprintf(stderr,"Internal error in range_decode_equiprobable().\n");
-  
-  s=v*alphabet_size/space;
-  fprintf(stderr,"Estimated s=%d (0x%x)\n",s,s);
-  for(symbol=s?s-1:0;symbol<s+2&&symbol<alphabet_size;symbol++)
-    {
-      unsigned int p_low,p_high;
-      c->debug="here";
-      range_equiprobable_range(c,alphabet_size,symbol,&p_low,&p_high);
-      fprintf(stderr,"tried symbol=%d (0x%x) : p_low=0x%x, p_high=0x%x\n",
-	      symbol,symbol,p_low,p_high);
-      if (range_decode_common(c,p_low,p_high,symbol)) {
-	fprintf(stderr,"  and range_decode_common() failed.\n");
-      }
-    } 
+  unsigned int p_low,p_high;
+  range_equiprobable_range(c,alphabet_size,symbol,&p_low,&p_high);
+  if (!range_decode_common(c,p_low,p_high,symbol)) {
+    if (c->debug) 
+      fprintf(stderr,"Decoding %d/%d p_low=0x%x, p_high=0x%x\n",
+	      symbol,alphabet_size,p_low,p_high);
+    return symbol;     
+  }
 
-  exit(-1);
+  if (c->debug) {
+    fprintf(stderr,"range_decode_equiprobable() failed.\n");
+    fprintf(stderr,"target=0x%llx, symbol=%d/%d : p_low=0x%x, p_high=0x%x\n",
+	    target,symbol,alphabet_size,p_low,p_high);
+  }
+  c->errors++;
+  return -1;
 }
 
 
@@ -431,11 +747,14 @@ int range_status(range_coder *c,int decoderP)
    in the current range */
 int range_conclude(range_coder *c)
 {
+  if (c->format==RANGE_FORMAT_BYTEWISE) return range_byte_conclude(c);
+  if (c->format==RANGE_FORMAT_RANS) return range_rans_conclude(c);
+
   int bits;
   unsigned int v;
   unsigned int mean=((c->high-c->low)/2)+c->low;
 
-  range_check(c,__LINE__);
+  if (range_check(c,__LINE__)) return -1;
 
   int i,msb=(mean>>31)&1;
 
@@ -467,7 +786,8 @@ int range_conclude(range_coder *c)
       if (bits>=32) {
 	fprintf(stderr,"Could not conclude coder:\n");
 	fprintf(stderr,"  low=0x%08x, high=0x%08x\n",c->low,c->high);
-	exit(-1);
+	c->errors++;
+	return -1;
       }
       v=(mean>>(32-bits))<<(32-bits);
       mask=0xffffffff>>bits;
@@ -508,15 +828,116 @@ int range_coder_reset(struct range_coder *c)
   c->bits_used=0;
   c->underflow=0;
   c->errors=0;
+  c->decodingP=0;
+  c->value=0;
+  c->wide_low=0;
+  c->wide_range=WIDE_MASK;
+  c->wide_cache=0;
+  c->wide_cache_size=0;
+  c->rans_next=0;
+  c->rans_pending_count=0;
   return 0;
 }
 
-struct range_coder *range_new_coder(int bytes)
+/* A checkpoint is simply a copy of the coder state.  Restoring one discards
+   everything encoded since, so that alternative encodings can be tried
+   from the same starting point. */
+int range_coder_checkpoint(range_coder *c,range_coder *checkpoint)
+{
+  bcopy(c,checkpoint,sizeof(range_coder));
+  return 0;
+}
+
+/* range_emitbit() only clears a byte when it starts writing it, so any bits
+   written beyond bits_used in the current byte have to be cleared before
+   encoding can resume. */
+int range_clear_tail(range_coder *c)
+{
+  if (c->bits_used&7)
+    c->bit_stream[c->bits_used>>3]&=0xff<<(8-(c->bits_used&7));
+  return 0;
+}
+
+int range_coder_restore(range_coder *c,range_coder *checkpoint)
+{
+  /* The rANS queue may have been reallocated since the checkpoint */
+  unsigned int *pending=c->rans_pending;
+  int pending_size=c->rans_pending_size;
+  if (c!=checkpoint) bcopy(checkpoint,c,sizeof(range_coder));
+  c->rans_pending=pending;
+  c->rans_pending_size=pending_size;
+  return range_clear_tail(c);
+}
+
+/* Where the encoded form of c lives: the bit stream, or for the rANS
+   format, the queue of symbols that have yet to be coded. */
+unsigned char *range_coder_encoded(range_coder *c,int *start,int *end,
+				   range_coder *checkpoint)
+{
+  if (c->format==RANGE_FORMAT_RANS) {
+    *start=checkpoint->rans_pending_count*2*sizeof(unsigned int);
+    *end=c->rans_pending_count*2*sizeof(unsigned int);
+    return (unsigned char *)c->rans_pending;
+  }
+  *start=checkpoint->bits_used>>3;
+  *end=(c->bits_used+7)>>3;
+  return c->bit_stream;
+}
+
+/* Copies out what has been encoded since checkpoint, so that it can be put
+   back with range_coder_restore_saved() after trying something else from
+   the same checkpoint.  Returns the number of bytes copied, or -1 if they
+   do not fit in size bytes. */
+int range_coder_save_since(range_coder *c,range_coder *checkpoint,
+			   unsigned char *buffer,int size)
+{
+  int start,end;
+  unsigned char *encoded=range_coder_encoded(c,&start,&end,checkpoint);
+  if (end-start>size) return -1;
+  bcopy(&encoded[start],buffer,end-start);
+  return end-start;
+}
+
+/* Restores the checkpoint state taken straight after the bytes were
+   saved by range_coder_save_since(), and puts the bytes back. */
+int range_coder_restore_saved(range_coder *c,range_coder *state,
+			      unsigned char *buffer,int bytes)
+{
+  int start,end;
+  range_coder_restore(c,state);
+  unsigned char *encoded=range_coder_encoded(c,&start,&end,c);
+  bcopy(buffer,&encoded[end-bytes],bytes);
+  return 0;
+}
+
+/* Returns the number of bits that c would occupy if it were concluded now,
+   or -1 if it could not be concluded, without disturbing c. */
+int range_conclude_bits(range_coder *c)
+{
+  range_coder t;
+  bcopy(c,&t,sizeof(range_coder));
+  int bits=range_conclude(&t)?-1:t.bits_used;
+  range_clear_tail(c);
+  return bits;
+}
+
+/* Set up a coder in storage provided by the caller, e.g., on the stack,
+   writing to or reading from the bytes bytes at buffer.  The coder must
+   not be passed to range_coder_free().  Encoding in the rANS format
+   allocates a queue, which range_coder_release() frees. */
+int range_coder_init(range_coder *c,unsigned char *buffer,int bytes)
 {
-  struct range_coder *c=calloc(sizeof(struct range_coder),1);
-  c->bit_stream=malloc(bytes);
+  bzero(c,sizeof(range_coder));
+  c->bit_stream=buffer;
   c->bit_stream_length=bytes*8;
   range_coder_reset(c);
+  return 0;
+}
+
+struct range_coder *range_new_coder(int bytes)
+{
+  struct range_coder *c=malloc(sizeof(struct range_coder));
+  range_coder_init(c,malloc(bytes),bytes);
   return c;
 }
 
@@ -526,7 +947,7 @@ struct range_coder *range_new_coder(int bytes)
 int range_encode_symbol(range_coder *c,unsigned int frequencies[],int alphabet_size,int symbol)
 {
   if (c->errors) return -1;
-  range_check(c,__LINE__);
+  if (range_check(c,__LINE__)) return -1;
 
   assert(symbol>=0);
   assert(symbol<alphabet_size);
@@ -546,7 +967,8 @@ int range_check(range_coder *c,int line)
     {
       if (!line) return -1;
       fprintf(stderr,"c->low >= c->high at line %d\n",line);
-      exit(-1);
+      c->errors++;
+      return -1;
     }
   if (!c->decodingP) return 0;
 
@@ -556,42 +978,78 @@ int range_check(range_coder *c,int line)
     fprintf(stderr,"  low=0x%08x, value=0x%08x, high=0x%08x\n",
 	    c->low,c->value,c->high);
     range_status(c,1);
-    exit(-1);
+    c->errors++;
+    return -1;
   }
   return 0;
 }
 
-int range_decode_symbol(range_coder *c,unsigned int frequencies[],int alphabet_size)
+/* Index of the first of count cumulative frequencies that is >= target, or
+   count if there is none.  The loop has no data-dependent branches, so
+   the compiler can turn the comparison into a conditional move. */
+int range_search_frequencies(unsigned int frequencies[],int count,
+			     unsigned int target)
+{
+  if (count<1) return 0;
+  unsigned int *base=frequencies;
+  while(count>1) {
+    int half=count>>1;
+    base=(base[half]<target)?base+half:base;
+    count-=half;
+  }
+  return (base-frequencies)+(*base<target);
+}
+
+/* Work out the target value for range_search_frequencies(), i.e., the
+   smallest cumulative frequency whose upper boundary lies above the
+   value being decoded.  Returns -1, counting an error, if the value has
+   left the range, as it does when the input is corrupt. */
+int range_decode_target(range_coder *c,unsigned int *target_out)
 {
+  unsigned long long target;
+
+  if (c->format==RANGE_FORMAT_BYTEWISE) {
+    /* The byte-oriented decoder can work out exactly where the value
+       falls in probability space, so no need to compute each boundary */
+    *target_out=range_byte_target(c)+1;
+    return 0;
+  }
+  if (c->format==RANGE_FORMAT_RANS) {
+    *target_out=range_rans_target(c);
+    return 0;
+  }
+
   c->decodingP=1;
-  range_check(c,__LINE__);
+  int outside=range_check(c,0);
   c->decodingP=0;
-  int s;
+  if (outside) {
+    c->errors++;
+    return -1;
+  }
   unsigned long long space=range_space(c);
-  //  unsigned long long v=(((unsigned long long)(c->value-c->low))<<24LL)/space;
   
   if (c->debug) printf(" decode: value=0x%08x; ",c->value);
   // range_status(c);
-  
-  for(s=0;s<(alphabet_size-1);s++) {
-    unsigned int boundary=c->low+((frequencies[s]*space)>>(32LL-SHIFTUPBITS));
-    if (c->value<boundary) {
-      if (c->debug) {
-	printf("value(0x%x) < frequencies[%d](boundary = 0x%x)\n",
-	       c->value,s,boundary);
-	if (s>0) {
-	  boundary=c->low+((frequencies[s-1]*space)>>(32LL-SHIFTUPBITS));
-	  printf("  previous boundary @ 0x%08x\n",boundary);
-	}
-      }
-      break;
-    } else {
-      if (0&&c->debug)
-	printf("value(0x%x) >= frequencies[%d](boundary = 0x%x)\n",
-	       c->value,s,boundary);
-    }
-  }
-  
+
+  /* The boundary above symbol s is low+((frequencies[s]*space)>>24),
+     and value is below it exactly when 
+     frequencies[s]*space >= (value-low+1)<<24.
+     So one division tells us the smallest frequency whose boundary lies
+     above value, and we can binary search for that instead of computing
+     every boundary in turn. */
+  target=0xffffffff;
+  if (space)
+    target=((((unsigned long long)(c->value-c->low)+1)<<(32LL-SHIFTUPBITS))
+	    +space-1)/space;
+  if (target>0xffffffff) target=0xffffffff;
+  *target_out=target;
+  return 0;
+}
+
+/* Consume symbol s, once the decoder has worked out which one it is */
+int range_decode_found_symbol(range_coder *c,unsigned int frequencies[],
+			      int alphabet_size,int s)
+{
   unsigned int p_low=0;
   if (s>0) p_low=frequencies[s-1];
   unsigned int p_high=MAXVALUEPLUS1;
@@ -604,12 +1062,57 @@ int range_decode_symbol(range_coder *c,unsigned int frequencies[],int alphabet_s
   // printf("in decode_symbol() about to call decode_common()\n");
   // range_status(c,1);
   if (range_decode_common(c,p_low,p_high,s)) {
-    fprintf(stderr,"range_decode_common() failed for some reason.\n");
-    exit(-1);
+    if (c->debug) fprintf(stderr,"range_decode_common() failed for some reason.\n");
+    c->errors++;
+    return -1;
   }
   return s;
 }
 
+int range_decode_symbol(range_coder *c,unsigned int frequencies[],int alphabet_size)
+{
+  unsigned int target;
+  if (range_decode_target(c,&target)) return -1;
+  int s=range_search_frequencies(frequencies,alphabet_size-1,target);
+  return range_decode_found_symbol(c,frequencies,alphabet_size,s);
+}
+
+int range_build_frequency_index(struct range_frequency_index *ix,
+				unsigned int frequencies[],int alphabet_size)
+{
+  int b;
+  for(b=0;b<=FREQUENCY_INDEX_BUCKETS;b++)
+    ix->first[b]=range_search_frequencies(frequencies,alphabet_size-1,
+					  b<<FREQUENCY_INDEX_SHIFT);
+  return 0;
+}
+
+/* As range_decode_symbol(), but using an index built by
+   range_build_frequency_index() to narrow the search to the symbols whose
+   boundaries share the top bits of the target.  The index may have been
+   built for a larger alphabet, of which this one is the first
+   alphabet_size symbols, as when only the characters of a unicode page
+   can follow. */
+int range_decode_symbol_indexed(range_coder *c,unsigned int frequencies[],
+				int alphabet_size,
+				struct range_frequency_index *ix)
+{
+  unsigned int target;
+  if (range_decode_target(c,&target)) return -1;
+  int s;
+  if (target>MAXVALUE)
+    s=range_search_frequencies(frequencies,alphabet_size-1,target);
+  else {
+    int b=target>>FREQUENCY_INDEX_SHIFT;
+    int first=ix->first[b];
+    int last=ix->first[b+1];
+    if (first>alphabet_size-1) first=alphabet_size-1;
+    if (last>alphabet_size-1) last=alphabet_size-1;
+    s=first+range_search_frequencies(&frequencies[first],last-first,target);
+  }
+  return range_decode_found_symbol(c,frequencies,alphabet_size,s);
+}
+
 int range_calc_new_range(range_coder *c,
 			 unsigned int p_low, unsigned int p_high,
 			 unsigned int *new_low,unsigned int *new_high)
@@ -650,6 +1153,11 @@ int range_decode_common(range_coder *c,unsigned int p_low,unsigned int p_high,in
 {
   unsigned int new_low,new_high;
 
+  if (c->format==RANGE_FORMAT_BYTEWISE)
+    return range_byte_decode_common(c,p_low,p_high);
+  if (c->format==RANGE_FORMAT_RANS)
+    return range_rans_decode_common(c,p_low,p_high);
+
   // If there are no more bits, and low and high are the same, then we have no more
   // data from which to decode
   if ((c->bits_used>=c->bit_stream_length)
@@ -658,42 +1166,19 @@ int range_decode_common(range_coder *c,unsigned int p_low,unsigned int p_high,in
       return -1;
     }
   
-  if (range_check(c,0 /* don't abort if things go wrong */)) {
-    if (c->debug) fprintf(stderr,"range check failed at %s:%d\n",__FILE__,__LINE__);
-    return -1;
-  }
-
-  if (range_calc_new_range(c,p_low,p_high,&new_low,&new_high)) {
-    if (c->debug) fprintf(stderr,"range calc new range failed at %s:%d\n",__FILE__,__LINE__);
-    return -1;
-  }
-
-  if (new_high>0xffffffff) {
-    printf("new_high=0x%08x\n",new_high);
-    new_high=0xffffffff;
-  }
-
-  if (0) {
-    printf("rdc: low=0x%08x, value=0x%08x, high=0x%08x\n",c->low,c->value,c->high);
-    printf("rdc: p_low=0x%08x, p_high=0x%08x, space=%08llx, s=%d\n",
-	   p_low,p_high,range_space(c),s);  
-  }
-
+  /* With decodingP set, range_check() and range_calc_new_range() also
+     make sure that value lies within the current and the new range */
   c->decodingP=1;
   if (range_check(c,0 /* don't abort if things go wrong */)) {
     if (c->debug) fprintf(stderr,"range check failed at %s:%d\n",__FILE__,__LINE__);
     return -1;
   }
 
-  if (new_low>c->value||new_high<c->value) {
+  if (range_calc_new_range(c,p_low,p_high,&new_low,&new_high)) {
     if (c->debug) {
-      fprintf(stderr,"c->value would be out of bounds at %s:%d\n",__FILE__,__LINE__);
-      fprintf(stderr,"  new_low=0x%08x, c->value=0x%08x, new_high=0x%08x\n",new_low,c->value,new_high);
-      fprintf(stderr,"  low=0x%08x, value=0x%08x, high=0x%08x\n",c->low,c->value,c->high);
+      fprintf(stderr,"range calc new range failed at %s:%d\n",__FILE__,__LINE__);
       fprintf(stderr,"  p_low=0x%08x, p_high=0x%08x, space=%08llx, s=%d\n",
 	      p_low,p_high,range_space(c),s);
-      fprintf(stderr,"  c->low=0x%x, c->high=0x%x\n",c->low,c->high);
-    
     }
     return -1;
   }
@@ -712,9 +1197,9 @@ int range_decode_common(range_coder *c,unsigned int p_low,unsigned int p_high,in
   // printf("after decode before renormalise:\n");
   // range_status(c,1);
 
-  range_emit_stable_bits(c);
+  if (range_emit_stable_bits(c)) return -1;
   c->decodingP=0;
-  range_check(c,__LINE__);
+  if (range_check(c,__LINE__)) return -1;
 
   if (c->debug) printf("%s: after rescale: low=0x%08x, high=0x%08x\n",
 		       c->debug,c->low,c->high);
@@ -724,6 +1209,9 @@ int range_decode_common(range_coder *c,unsigned int p_low,unsigned int p_high,in
 
 int range_decode_prefetch(range_coder *c)
 {
+  if (c->format==RANGE_FORMAT_BYTEWISE) return range_byte_prefetch(c);
+  if (c->format==RANGE_FORMAT_RANS) return range_rans_prefetch(c);
+
   c->low=0;
   c->high=0xffffffff;
   c->value=0;
@@ -764,9 +1252,24 @@ range_coder *range_coder_dup(range_coder *in)
     exit(-1);
   }
   bcopy(in->bit_stream,out->bit_stream,bits2bytes(out->bits_used));
+  /* The copy gets its own rANS queue when it needs one */
+  out->rans_pending=NULL;
+  out->rans_pending_count=0;
+  out->rans_pending_size=0;
   return out;
 }
 
+/* Free what a coder set up by range_coder_init() has allocated, but not
+   its buffer or the coder itself */
+int range_coder_release(range_coder *c)
+{
+  if (c->rans_pending) free(c->rans_pending);
+  c->rans_pending=NULL;
+  c->rans_pending_size=0;
+  c->rans_pending_count=0;
+  return 0;
+}
+
 int range_coder_free(range_coder *c)
 {
   if (!c->bit_stream) {
@@ -774,12 +1277,15 @@ int range_coder_free(range_coder *c)
     exit(-1);
   }
   free(c->bit_stream); c->bit_stream=NULL;
+  range_coder_release(c);
   bzero(c,sizeof(range_coder));
   free(c);
   return 0;
 }
 
 #ifdef TESTMODE
+#include <sys/time.h>
+
 int test_foo1(range_coder *c)
 {
   fprintf(stderr,"Testing a use case that failed some time.\n");
@@ -1020,10 +1526,21 @@ int test_equiprobable(range_coder *c)
   
   fprintf(stderr,"Running tests on equiprobable encoding.\n");
 
+  int a,s;
+  for(a=1;a<=RECIPROCAL_LIMIT;a++)
+    for(s=0;s<=a;s++)
+      if (range_equiprobable_boundary(a,s)
+	  !=(((unsigned long long)s)*MAXVALUE)/a) {
+	fprintf(stderr,"reciprocal boundary wrong for symbol %d of %d\n",s,a);
+	exit(-1);
+      }
+
   c->debug=NULL;
   for(i=0;i<1000000;i++)
     {
       int alphabet_size=random();
+      /* Also exercise the reciprocal path for small alphabets */
+      if (i&1) alphabet_size%=RECIPROCAL_LIMIT+1;
       if (!alphabet_size) alphabet_size=1;
       int symbol=random()%alphabet_size;
       range_coder_reset(c);
@@ -1389,6 +1906,368 @@ int test_verify(range_coder *c)
   return 0;
 }
 
+int test_corrupt(range_coder *c)
+{
+  unsigned int frequencies[64];
+  int format,test,i;
+
+  printf("Checking that bad input is reported instead of aborting.\n");
+  int bit_stream_length=c->bit_stream_length;
+
+  srandom(0);
+  for(format=RANGE_FORMAT_BITWISE;format<=RANGE_FORMAT_RANS;format++) {
+    /* Random data must decode to symbols within the alphabet, or fail */
+    for(test=0;test<10000;test++) {
+      range_coder_reset(c);
+      c->format=format;
+      for(i=0;i<64;i++) c->bit_stream[i]=random();
+      c->bit_stream_length=64*8;
+      range_decode_prefetch(c);
+      for(i=0;i<256;i++) {
+	int alphabet_size=1+random()%64,symbol,j;
+	if (i&1) {
+	  unsigned int cumulative=0;
+	  for(j=0;j<alphabet_size-1;j++) {
+	    cumulative+=random()%(MAXVALUE/alphabet_size);
+	    frequencies[j]=cumulative;
+	  }
+	  symbol=range_decode_symbol(c,frequencies,alphabet_size);
+	} else
+	  symbol=range_decode_equiprobable(c,alphabet_size);
+	if (symbol>=alphabet_size||(symbol<0&&!c->errors)) {
+	  fprintf(stderr,"Test #%d failed: decoded symbol %d of %d, with %d errors\n",
+		  test,symbol,alphabet_size,c->errors);
+	  exit(-1);
+	}
+	if (symbol<0) break;
+      }
+    }
+
+    /* Running out of space while encoding.  The rANS coder only finds
+       out when it is concluded. */
+    range_coder *small=range_new_coder(2);
+    small->format=format;
+    for(i=0;i<64;i++) if (range_encode_equiprobable(small,256,i)) break;
+    if (i==64) range_conclude(small);
+    if (!small->errors) {
+      fprintf(stderr,"Encoding 64 bytes into 2 did not fail\n");
+      exit(-1);
+    }
+    range_coder_free(small);
+  }
+
+  /* Value outside of the range being decoded */
+  range_coder_reset(c);
+  c->format=RANGE_FORMAT_BITWISE;
+  c->low=0x40000000; c->value=0x10000000;
+  if (range_decode_equiprobable(c,10)!=-1||!c->errors||c->decodingP) {
+    fprintf(stderr,"Decoding with value out of range did not fail cleanly\n");
+    exit(-1);
+  }
+  c->errors=0;
+  if (range_decode_symbol(c,frequencies,2)!=-1||!c->errors||c->decodingP) {
+    fprintf(stderr,"Decoding a symbol with value out of range did not fail cleanly\n");
+    exit(-1);
+  }
+  range_coder_reset(c);
+  c->bit_stream_length=bit_stream_length;
+  printf("   -- passed.\n");
+  return 0;
+}
+
+int test_checkpoint(range_coder *c)
+{
+  int format,test,i;
+  int prefix[64],a[64],b[64];
+
+  printf("Testing that restoring a checkpoint discards what was encoded since.\n");
+
+  srandom(0);
+  for(format=RANGE_FORMAT_BITWISE;format<=RANGE_FORMAT_RANS;format++)
+    for(test=0;test<10000;test++) {
+      int alphabet_size=2+random()%300;
+      int prefix_len=random()%64,a_len=random()%64,b_len=random()%64;
+      for(i=0;i<prefix_len;i++) prefix[i]=random()%alphabet_size;
+      for(i=0;i<a_len;i++) a[i]=random()%alphabet_size;
+      for(i=0;i<b_len;i++) b[i]=random()%alphabet_size;
+
+      range_coder checkpoint;
+      range_coder_reset(c);
+      c->format=format;
+      for(i=0;i<prefix_len;i++) range_encode_equiprobable(c,alphabet_size,prefix[i]);
+      range_coder_checkpoint(c,&checkpoint);
+      for(i=0;i<a_len;i++) range_encode_equiprobable(c,alphabet_size,a[i]);
+      range_conclude_bits(c);
+      range_coder_restore(c,&checkpoint);
+      for(i=0;i<b_len;i++) range_encode_equiprobable(c,alphabet_size,b[i]);
+      range_conclude(c);
+
+      range_coder *vc=range_coder_dup(c);
+      vc->bit_stream_length=vc->bits_used;
+      vc->bits_used=0;
+      range_decode_prefetch(vc);
+      for(i=0;i<prefix_len+b_len;i++) {
+	int expected=(i<prefix_len)?prefix[i]:b[i-prefix_len];
+	int symbol=range_decode_equiprobable(vc,alphabet_size);
+	if (symbol!=expected) {
+	  fprintf(stderr,"Test #%d failed: symbol #%d decoded as %d instead of %d\n",
+		  test,i,symbol,expected);
+	  exit(-1);
+	}
+      }
+      range_coder_free(vc);
+    }
+  c->format=RANGE_FORMAT_BITWISE;
+  printf("   -- passed.\n");
+  return 0;
+}
+
+int test_indexed(range_coder *c)
+{
+  unsigned int frequencies[1024];
+  int sequence[1024];
+  struct range_frequency_index ix;
+  int test,i;
+
+  printf("Testing indexed decoding against range_decode_symbol().\n");
+
+  srandom(0);
+  for(test=0;test<1024;test++)
+    {
+      int alphabet_size=1+test;
+      /* Skew the distribution so that many boundaries share a bucket,
+	 like the message length table does. */
+      unsigned int cumulative=0;
+      for(i=0;i<alphabet_size-1;i++) {
+	cumulative+=1+((i<16)?random()%0x80000:random()%0x100);
+	if (cumulative>MAXVALUE) cumulative=MAXVALUE;
+	frequencies[i]=cumulative;
+      }
+      range_build_frequency_index(&ix,frequencies,alphabet_size);
+      /* Every other test codes only the first half of the alphabet with
+	 the same index, as decodeLCAlphaSpace() does after a unicode page
+	 switch. */
+      if (test&1) alphabet_size=(alphabet_size+1)/2;
+
+      int length=1+random()%1023;
+      for(i=0;i<length;i++) {
+	/* pick symbols in proportion to their probabilities */
+	unsigned int p=random()&MAXVALUE;
+	sequence[i]=range_search_frequencies(frequencies,alphabet_size-1,p+1);
+      }
+      
+      range_coder_reset(c);
+      for(i=0;i<length;i++) range_encode_symbol(c,frequencies,alphabet_size,sequence[i]);
+      range_conclude(c);
+
+      range_coder *vc=range_coder_dup(c);
+      vc->bit_stream_length=vc->bits_used;
+      vc->bits_used=0;
+      range_decode_prefetch(vc);
+      for(i=0;i<length;i++) {
+	int symbol=range_decode_symbol_indexed(vc,frequencies,alphabet_size,&ix);
+	if (symbol!=sequence[i]) {
+	  fprintf(stderr,"Test #%d failed: indexed decode of symbol #%d gave %d instead of %d\n",
+		  test,i,symbol,sequence[i]);
+	  exit(-1);
+	}
+      }
+      range_coder_free(vc);
+    }
+  printf("   -- passed.\n");
+  return 0;
+}
+
+long long test_time_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_usec+tv.tv_sec*1000000LL;
+}
+
+char *format_names[3]={"bitwise ","bytewise","rans    "};
+
+/* Encode the same random corpus of symbol sequences with each of the coders,
+   check that they decode back to exactly the symbols that went in, and
+   report how long each took.  Then encode a batch of short messages, like
+   the ones smac is used for, to see how many bits each coder needs beyond
+   the entropy of the symbols. */
+int test_formats(range_coder *c)
+{
+  unsigned int frequencies[1024];
+  int sequence[1024];
+  int alphabet_size;
+  int length;
+  int test,i,format;
+  int testCount=4096;
+  long long encode_us[3]={0,0,0},decode_us[3]={0,0,0},bits[3]={0,0,0};
+  double overhead[3]={0,0,0};
+  long long symbols=0;
+
+  printf("Comparing bitwise, bytewise and rANS coders on %d random sequences.\n",testCount);
+
+  range_coder *coders[3];
+  for(format=0;format<3;format++) {
+    coders[format]=range_new_coder(8192);
+    coders[format]->format=format;
+  }
+
+  srandom(0);
+  for(test=0;test<testCount*2;test++)
+    {
+      /* The second half of the tests are short messages of 5 to 40
+	 symbols, with a skewed distribution like that of characters in
+	 text. */
+      int shortP=test>=testCount;
+      alphabet_size=1+test%1024;
+      if (shortP) alphabet_size=2+test%30;
+    newalphabet:
+      if (shortP) {
+	unsigned int cumulative=0;
+	for(i=0;i<alphabet_size-1;i++) {
+	  cumulative+=1+(MAXVALUE-cumulative)/4;
+	  frequencies[i]=cumulative;
+	}
+      } else {
+	for(i=0;i<alphabet_size-1;i++)
+	  frequencies[i]=random()&MAXVALUE;
+	frequencies[alphabet_size-1]=0;
+	qsort(frequencies,alphabet_size-1,sizeof(unsigned int),cmp_uint);
+	for(i=0;i<alphabet_size-1;i++)
+	  if (frequencies[i]==frequencies[i+1]||!frequencies[i]) goto newalphabet;
+      }
+
+      length=1+random()%1023;
+      if (shortP) length=5+random()%36;
+      for(i=0;i<length;i++) {
+	/* pick symbols in proportion to their probabilities */
+	unsigned int p=random()&MAXVALUE;
+	sequence[i]=range_search_frequencies(frequencies,alphabet_size-1,p+1);
+      }
+      if (!shortP) symbols+=length;
+
+      for(format=0;format<3;format++) {
+	range_coder *e=coders[format];
+	range_coder_reset(e);
+	long long start=test_time_us();
+	for(i=0;i<length;i++) {
+	  /* Mix in some equiprobable symbols as well */
+	  if (i&1) range_encode_equiprobable(e,alphabet_size,sequence[i]);
+	  else range_encode_symbol(e,frequencies,alphabet_size,sequence[i]);
+	}
+	double entropy=e->entropy;
+	range_conclude(e);
+	if (shortP) overhead[format]+=e->bits_used-entropy;
+	else {
+	  encode_us[format]+=test_time_us()-start;
+	  bits[format]+=e->bits_used;
+	}
+
+	range_coder *vc=range_coder_dup(e);
+	vc->bit_stream_length=vc->bits_used;
+	vc->bits_used=0;
+	start=test_time_us();
+	range_decode_prefetch(vc);
+	for(i=0;i<length;i++) {
+	  int symbol;
+	  if (i&1) symbol=range_decode_equiprobable(vc,alphabet_size);
+	  else symbol=range_decode_symbol(vc,frequencies,alphabet_size);
+	  if (symbol!=sequence[i]) {
+	    fprintf(stderr,"Test #%d failed: %s coder decoded symbol #%d as %d instead of %d (alphabet_size=%d)\n",
+		    test,format_names[format],i,symbol,sequence[i],alphabet_size);
+	    exit(-1);
+	  }
+	}
+	if (!shortP) decode_us[format]+=test_time_us()-start;
+	range_coder_free(vc);
+      }
+    }
+
+  for(format=0;format<3;format++)
+    printf("  %s: %lld symbols in %lld bits, encode %.1f ns/symbol, decode %.1f ns/symbol, short message overhead %.1f bits\n",
+	   format_names[format],symbols,bits[format],
+	   encode_us[format]*1000.0/symbols,decode_us[format]*1000.0/symbols,
+	   overhead[format]/testCount);
+
+  for(format=0;format<3;format++) range_coder_free(coders[format]);
+  printf("   -- passed.\n");
+  return 0;
+}
+
+/* Checks that each format still produces exactly the stream it always
+   has for a fixed sequence, so that a change to a format that is made to
+   the encoder and decoder alike cannot go unnoticed.  The bitwise stream
+   is the one the original coder produced. */
+int test_known_streams(range_coder *c)
+{
+  unsigned int frequencies[3]={0x200000,0x900000,0xe00000};
+  int sequence[]={1,0,2,3,1,1,3,0,0,2,1,3,2,2,0,1,3,1,0,2,1,1,2,3};
+  int known_bits[3]={100,104,144};
+  unsigned char known[3][18]={
+    {0x26,0xc3,0x20,0x55,0x39,0x3c,0x1a,0x7c,0x31,0x3a,0xff,0x12,0xe0},
+    {0x26,0xc3,0x20,0x93,0xa2,0xfd,0x5e,0xac,0xe3,0x66,0x01,0x82,0x29},
+    {0x03,0x4b,0x3f,0xba,0x04,0x02,0xe1,0x3f,0xf2,0x9e,0x0b,0x49,0x7d,
+     0x35,0x2c,0xdd,0x70,0x87}};
+  int length=sizeof(sequence)/sizeof(int);
+  int format,i;
+
+  printf("Checking each format against a known stream.\n");
+
+  for(format=RANGE_FORMAT_BITWISE;format<=RANGE_FORMAT_RANS;format++) {
+    range_coder_reset(c);
+    c->format=format;
+    for(i=0;i<length;i++) {
+      if (i%3==2) range_encode_equiprobable(c,300,sequence[i]*71+i);
+      else range_encode_symbol(c,frequencies,4,sequence[i]);
+    }
+    range_conclude(c);
+    if (c->bits_used!=known_bits[format]
+	||memcmp(c->bit_stream,known[format],(known_bits[format]+7)/8)) {
+      fprintf(stderr,"%s coder produced a different stream (%d bits):",
+	      format_names[format],c->bits_used);
+      for(i=0;i<(c->bits_used+7)/8;i++) fprintf(stderr," %02x",c->bit_stream[i]);
+      fprintf(stderr,"\n");
+      exit(-1);
+    }
+
+    /* A coder in the caller's storage must give the same stream */
+    unsigned char buffer[64];
+    range_coder s;
+    range_coder_init(&s,buffer,sizeof(buffer));
+    s.format=format;
+    for(i=0;i<length;i++) {
+      if (i%3==2) range_encode_equiprobable(&s,300,sequence[i]*71+i);
+      else range_encode_symbol(&s,frequencies,4,sequence[i]);
+    }
+    range_conclude(&s);
+    range_coder_release(&s);
+    if (s.bits_used!=c->bits_used||memcmp(buffer,c->bit_stream,(s.bits_used+7)/8)) {
+      fprintf(stderr,"%s coder in caller's storage produced a different stream\n",
+	      format_names[format]);
+      exit(-1);
+    }
+
+    range_coder *vc=range_coder_dup(c);
+    vc->bit_stream_length=vc->bits_used;
+    vc->bits_used=0;
+    range_decode_prefetch(vc);
+    for(i=0;i<length;i++) {
+      int expected=(i%3==2)?sequence[i]*71+i:sequence[i];
+      int symbol=(i%3==2)?range_decode_equiprobable(vc,300)
+	:range_decode_symbol(vc,frequencies,4);
+      if (symbol!=expected) {
+	fprintf(stderr,"%s coder decoded symbol #%d of the known stream as %d instead of %d\n",
+		format_names[format],i,symbol,expected);
+	exit(-1);
+      }
+    }
+    range_coder_free(vc);
+  }
+  c->format=RANGE_FORMAT_BITWISE;
+  printf("   -- passed.\n");
+  return 0;
+}
+
 int main() {
   struct range_coder *c=range_new_coder(8192);
 
@@ -1398,6 +2277,11 @@ int main() {
   test_fineslices(c);
   test_equiprobable(c);
   test_verify(c);
+  test_indexed(c);
+  test_corrupt(c);
+  test_checkpoint(c);
+  test_formats(c);
+  test_known_streams(c);
 
   return 0;
 }
@@ -16,6 +16,18 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+/* Stream formats.  The encoder and decoder must agree on the format,
+   which is selected by setting c->format before the first symbol is
+   coded.  The bitwise format is the original one, and is what stats.dat
+   files and existing compressed messages use. */
+#define RANGE_FORMAT_BITWISE 0
+#define RANGE_FORMAT_BYTEWISE 1
+#define RANGE_FORMAT_RANS 2
+
+/* Number of interleaved states used by the rANS format.  Each state costs
+   four bytes when the coder is concluded. */
+#define RANS_STATES 2
+
 typedef struct range_coder {
   unsigned int low;
   unsigned int high;
@@ -28,13 +40,47 @@ typedef struct range_coder {
   /* if non-zero, prevents use of underflow/overflow rescaling */
   int norescale;
 
+  /* if non-zero, entropy is not accumulated while encoding */
+  int noentropy;
+
   double entropy;
 
   unsigned char *bit_stream;
   int bit_stream_length;  
   unsigned int bits_used;
+
+  /* One of RANGE_FORMAT_* */
+  int format;
+
+  /* State of the byte-oriented coder.  wide_low holds 56 significant bits,
+     with bit 56 catching any carry that has yet to be propagated into
+     the output.  When decoding, wide_low holds the offset of the code
+     value from the bottom of the range instead. */
+  unsigned long long wide_low;
+  unsigned long long wide_range;
+  unsigned char wide_cache;
+  int wide_cache_size;
+
+  /* State of the rANS coder.  rANS decodes symbols in the opposite order
+     to which they were encoded, so the encoder queues the probability
+     range of each symbol in rans_pending, and range_conclude() codes them
+     all at once.  rans_pending is allocated as needed, and is kept when
+     a checkpoint is restored. */
+  unsigned int rans_state[RANS_STATES];
+  int rans_next;
+  unsigned int *rans_pending;
+  int rans_pending_count;
+  int rans_pending_size;
 } range_coder;
 
+/* Index over a fixed table of cumulative frequencies, recording for each
+   possible top byte of a 24-bit target which symbols can contain it. */
+#define FREQUENCY_INDEX_SHIFT 16
+#define FREQUENCY_INDEX_BUCKETS (1<<(24-FREQUENCY_INDEX_SHIFT))
+struct range_frequency_index {
+  unsigned short first[FREQUENCY_INDEX_BUCKETS+1];
+};
+
 int range_coder_reset(struct range_coder *c);
 int range_emit_stable_bits(range_coder *c);
 int range_encode(range_coder *c,unsigned int p_low,unsigned int p_high);
@@ -44,11 +90,25 @@ int range_encode_equiprobable(range_coder *c,int alphabet_size,int symbol);
 int range_decode_equiprobable(range_coder *c,int alphabet_size);
 int range_decode_common(range_coder *c,unsigned int p_low,unsigned int p_high,int s);
 int range_decode_symbol(range_coder *c,unsigned int frequencies[],int alphabet_size);
+int range_build_frequency_index(struct range_frequency_index *ix,
+				unsigned int frequencies[],int alphabet_size);
+int range_decode_symbol_indexed(range_coder *c,unsigned int frequencies[],
+				int alphabet_size,
+				struct range_frequency_index *ix);
 int range_decode_getnextbit(range_coder *c);
 struct range_coder *range_new_coder(int bytes);
+int range_coder_init(range_coder *c,unsigned char *buffer,int bytes);
+int range_coder_checkpoint(range_coder *c,range_coder *checkpoint);
+int range_coder_restore(range_coder *c,range_coder *checkpoint);
+int range_coder_save_since(range_coder *c,range_coder *checkpoint,
+			   unsigned char *buffer,int size);
+int range_coder_restore_saved(range_coder *c,range_coder *state,
+			      unsigned char *buffer,int bytes);
+int range_conclude_bits(range_coder *c);
 int range_encode_length(range_coder *c,int len);
 int range_conclude(range_coder *c);
 int range_coder_free(range_coder *c);
+int range_coder_release(range_coder *c);
 range_coder *range_coder_dup(range_coder *in);
 int range_rescale(range_coder *c);
 int range_unrescale_value(unsigned int v,int underflow_bits);
@@ -0,0 +1,242 @@
+/*
+Copyright (C) 2012 Paul Gardner-Stephen
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Microbenchmarks for the entropy coder primitives.
+
+  Times range_encode_symbol()/range_decode_symbol(),
+  range_encode_equiprobable()/range_decode_equiprobable() and
+  ic_encode_recursive()/ic_decode_recursive() for each stream format,
+  over the alphabet sizes that the models actually use, with both a flat
+  and a skewed (Zipf-like, as for characters in text) distribution.
+  Every run is decoded and checked against what was encoded.
+
+  Results are written to stdout as CSV, one line per operation, so that
+  the output of two builds can be compared with diff, join or a
+  spreadsheet.  The optional argument is the minimum time to spend on
+  each case, in milliseconds.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include "arithmetic.h"
+
+#define BENCH_SYMBOLS 65536
+#define BENCH_MAX_ALPHABET 1024
+
+#define BENCH_SYMBOL 0
+#define BENCH_EQUIPROBABLE 1
+#define BENCH_INTERPOLATIVE 2
+
+char *bench_operations[3][2]={
+  {"encode_symbol","decode_symbol"},
+  {"encode_equiprobable","decode_equiprobable"},
+  {"ic_encode_recursive","ic_decode_recursive"}};
+char *bench_formats[3]={"bitwise","bytewise","rans"};
+int bench_alphabet_sizes[]={2,10,65,256,640,1024,0};
+
+unsigned int frequencies[BENCH_MAX_ALPHABET];
+int sequence[BENCH_SYMBOLS];
+int decoded[BENCH_SYMBOLS];
+unsigned char stream[BENCH_SYMBOLS*4];
+
+long long bench_time_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_usec+tv.tv_sec*1000000LL;
+}
+
+/* Cumulative frequencies with every symbol equally likely, or with symbol
+   i having probability proportional to 1/(i+1).  Every symbol keeps a
+   non-zero share. */
+int bench_frequencies(int alphabet_size,int skewed)
+{
+  double weights[BENCH_MAX_ALPHABET];
+  double total=0,cumulative=0;
+  int i;
+
+  for(i=0;i<alphabet_size;i++) {
+    weights[i]=skewed?1.0/(i+1):1.0;
+    total+=weights[i];
+  }
+  for(i=0;i<alphabet_size-1;i++) {
+    cumulative+=weights[i];
+    frequencies[i]=cumulative/total*(0xffffff-alphabet_size)+i+1;
+  }
+  return 0;
+}
+
+/* Fill sequence[] with the symbols to code, and return how many there are.
+   For the interpolative coder, this is a strictly increasing list of
+   values below alphabet_size, either spread evenly or bunched towards
+   zero, repeated to make up a useful amount of work. */
+int bench_sequence(int operation,int alphabet_size,int skewed)
+{
+  int i,n=0;
+
+  if (operation!=BENCH_INTERPOLATIVE) {
+    for(i=0;i<BENCH_SYMBOLS;i++) {
+      /* pick symbols in proportion to their probabilities */
+      unsigned int p=random()&0xffffff;
+      int s;
+      for(s=0;s<alphabet_size-1;s++) if (frequencies[s]>p) break;
+      sequence[i]=s;
+    }
+    return BENCH_SYMBOLS;
+  }
+
+  while(n+alphabet_size<=BENCH_SYMBOLS) {
+    int first=n;
+    for(i=0;i<alphabet_size;i++)
+      if (skewed?(random()%(i+2)<2):(random()%4==0)) sequence[n++]=i;
+    if (n==first) sequence[n++]=random()%alphabet_size;
+  }
+  return n;
+}
+
+int bench_encode(int operation,range_coder *c,int alphabet_size,int count)
+{
+  int i;
+
+  switch(operation) {
+  case BENCH_SYMBOL:
+    for(i=0;i<count;i++)
+      if (range_encode_symbol(c,frequencies,alphabet_size,sequence[i]))
+	return -1;
+    return 0;
+  case BENCH_EQUIPROBABLE:
+    for(i=0;i<count;i++)
+      if (range_encode_equiprobable(c,alphabet_size,sequence[i])) return -1;
+    return 0;
+  }
+
+  /* Code each of the lists that make up the sequence in turn */
+  for(i=0;i<count;) {
+    int n=1;
+    while(i+n<count&&sequence[i+n]>sequence[i+n-1]) n++;
+    if (range_encode_equiprobable(c,alphabet_size+1,n)) return -1;
+    if (ic_encode_recursive(&sequence[i],n,alphabet_size,c)) return -1;
+    i+=n;
+  }
+  return 0;
+}
+
+int bench_decode(int operation,range_coder *c,int alphabet_size,int count)
+{
+  int i;
+
+  switch(operation) {
+  case BENCH_SYMBOL:
+    for(i=0;i<count;i++)
+      if ((decoded[i]=range_decode_symbol(c,frequencies,alphabet_size))<0)
+	return -1;
+    return 0;
+  case BENCH_EQUIPROBABLE:
+    for(i=0;i<count;i++)
+      if ((decoded[i]=range_decode_equiprobable(c,alphabet_size))<0)
+	return -1;
+    return 0;
+  }
+
+  for(i=0;i<count;) {
+    int n=range_decode_equiprobable(c,alphabet_size+1);
+    if (n<1||i+n>count) return -1;
+    if (ic_decode_recursive(&decoded[i],n,alphabet_size,c)) return -1;
+    i+=n;
+  }
+  return 0;
+}
+
+int bench_case(int operation,int format,int alphabet_size,int skewed,
+	       int min_us)
+{
+  long long encode_us=0,decode_us=0,symbols=0,bits=0;
+  int rounds=0;
+
+  /* Use the same symbols for every format, and in every build */
+  srandom(alphabet_size*2+skewed);
+  bench_frequencies(alphabet_size,skewed);
+  int count=bench_sequence(operation,alphabet_size,skewed);
+
+  range_coder *c=range_new_coder(sizeof(stream));
+  c->format=format;
+  c->noentropy=1;
+
+  while(rounds<3||encode_us+decode_us<min_us) {
+    range_coder_reset(c);
+    long long start=bench_time_us();
+    if (bench_encode(operation,c,alphabet_size,count)||range_conclude(c)) {
+      fprintf(stderr,"%s failed: format=%s, alphabet_size=%d\n",
+	      bench_operations[operation][0],bench_formats[format],
+	      alphabet_size);
+      exit(-1);
+    }
+    encode_us+=bench_time_us()-start;
+
+    range_coder d;
+    bcopy(c->bit_stream,stream,(c->bits_used+7)>>3);
+    range_coder_init(&d,stream,(c->bits_used+7)>>3);
+    d.format=format;
+    d.bit_stream_length=c->bits_used;
+    start=bench_time_us();
+    range_decode_prefetch(&d);
+    if (bench_decode(operation,&d,alphabet_size,count)
+	||memcmp(sequence,decoded,count*sizeof(int))) {
+      fprintf(stderr,"%s failed: format=%s, alphabet_size=%d\n",
+	      bench_operations[operation][1],bench_formats[format],
+	      alphabet_size);
+      exit(-1);
+    }
+    decode_us+=bench_time_us()-start;
+
+    symbols+=count;
+    bits+=c->bits_used;
+    rounds++;
+  }
+  range_coder_free(c);
+
+  int direction;
+  for(direction=0;direction<2;direction++) {
+    long long us=direction?decode_us:encode_us;
+    if (us<1) us=1;
+    printf("%s,%s,%d,%s,%lld,%.3f,%.2f,%.0f\n",
+	   bench_operations[operation][direction],bench_formats[format],
+	   alphabet_size,skewed?"skewed":"flat",symbols,bits*1.0/symbols,
+	   us*1000.0/symbols,symbols*1000000.0/us);
+  }
+  fflush(stdout);
+  return 0;
+}
+
+int main(int argc,char **argv)
+{
+  int min_us=(argc>1?atoi(argv[1]):50)*1000;
+  int operation,format,a,skewed;
+
+  printf("operation,format,alphabet_size,distribution,symbols,bits_per_symbol,ns_per_symbol,symbols_per_sec\n");
+  for(operation=BENCH_SYMBOL;operation<=BENCH_INTERPOLATIVE;operation++)
+    for(format=RANGE_FORMAT_BITWISE;format<=RANGE_FORMAT_RANS;format++)
+      for(a=0;bench_alphabet_sizes[a];a++)
+	for(skewed=0;skewed<2;skewed++)
+	  bench_case(operation,format,bench_alphabet_sizes[a],skewed,min_us);
+  return 0;
+}
@@ -0,0 +1,185 @@
+/*
+Copyright (C) 2012 Paul Gardner-Stephen
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Microbenchmark for finding the context of each character.
+
+  For every position of every message (one per line of the messages
+  file), finds the deepest node of the flattened tree that matches the
+  text so far, by walking down the tree with extractFlatNode(), and by
+  looking it up in the index built by stats_index_contexts() with
+  indexedFlatNode().  Where the model's contexts can be followed, also
+  times contextNext() from each character to the next, as
+  decodeLCAlphaSpace() does.  The index must find the same node as the
+  walk at every position.
+
+  Results are written to stdout as CSV, one line per model and method,
+  with the best time of five runs.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "arithmetic.h"
+#include "charset.h"
+#include "packed_stats.h"
+#include "unicode.h"
+
+__thread long long total_alpha_bits=0;
+__thread long long total_nonalpha_bits=0;
+__thread long long total_case_bits=0;
+__thread long long total_model_bits=0;
+__thread long long total_length_bits=0;
+__thread long long total_finalisation_bits=0;
+__thread long long total_unicode_millibits=0;
+__thread long long total_unicode_chars=0;
+
+#define BENCH_MAX_CHARS (4*1024*1024)
+#define BENCH_MAX_MESSAGES 65536
+#define BENCH_RUNS 5
+
+#define BENCH_WALK 0
+#define BENCH_INDEX 1
+#define BENCH_FOLLOW 2
+char *bench_methods[3]={"walk","index","follow"};
+
+unsigned short text[BENCH_MAX_CHARS];
+int message_start[BENCH_MAX_MESSAGES+1];
+int message_count=0;
+/* Where the nodes found go, so that none of the work can be skipped */
+unsigned long long bench_sink=0;
+
+long long bench_time_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_usec+tv.tv_sec*1000000LL;
+}
+
+int bench_read_messages(char *file)
+{
+  FILE *f=fopen(file,"r");
+  if (!f) {
+    fprintf(stderr,"Could not open %s\n",file);
+    return -1;
+  }
+  char line[8192];
+  int chars=0;
+  while(fgets(line,sizeof(line),f)&&message_count<BENCH_MAX_MESSAGES) {
+    int len=strlen(line);
+    while(len&&(line[len-1]=='\n'||line[len-1]=='\r')) line[--len]=0;
+    if (!len||len>1024||chars+len>BENCH_MAX_CHARS) continue;
+    int utf16_len;
+    if (utf8toutf16((unsigned char *)line,len,&text[chars],&utf16_len))
+      continue;
+    message_start[message_count++]=chars;
+    chars+=utf16_len;
+  }
+  message_start[message_count]=chars;
+  fclose(f);
+  return 0;
+}
+
+/* Find the context at every position in one of the ways, and return the
+   sum of the nodes found */
+unsigned long long bench_method(stats_handle *h,int method)
+{
+  unsigned long long sum=0;
+  int m,i;
+  for(m=0;m<message_count;m++) {
+    unsigned short *s=&text[message_start[m]];
+    int len=message_start[m+1]-message_start[m];
+    unsigned int node=0;
+    for(i=1;i<=len;i++) {
+      switch(method) {
+      case BENCH_WALK: node=extractFlatNode(s,i,h)-h->flat; break;
+      case BENCH_INDEX: node=indexedFlatNode(s,i,h); break;
+      case BENCH_FOLLOW: node=contextNext(h,node,s[i-1]); break;
+      }
+      sum+=node;
+    }
+  }
+  return sum;
+}
+
+/* The index must agree with the walk everywhere */
+int bench_check(stats_handle *h)
+{
+  int m,i;
+  for(m=0;m<message_count;m++) {
+    unsigned short *s=&text[message_start[m]];
+    int len=message_start[m+1]-message_start[m];
+    for(i=1;i<=len;i++)
+      if (indexedFlatNode(s,i,h)!=extractFlatNode(s,i,h)-h->flat) {
+	fprintf(stderr,"Index and tree disagree at character %d of message %d\n",
+		i,m+1);
+	return -1;
+      }
+  }
+  return 0;
+}
+
+int bench_model(char *file)
+{
+  stats_handle *h=stats_new_handle(file);
+  if (!h||stats_load_tree(h)) {
+    fprintf(stderr,"Could not load %s\n",file);
+    return -1;
+  }
+  long long start=bench_time_us();
+  if (stats_index_contexts(h)) return -1;
+  long long index_us=bench_time_us()-start;
+  if (bench_check(h)) return -1;
+
+  long long lookups=message_start[message_count]-message_start[0];
+  int method,run;
+  for(method=BENCH_WALK;method<=BENCH_FOLLOW;method++) {
+    if (method==BENCH_FOLLOW&&!h->flatExt) continue;
+    long long best_us=-1;
+    for(run=0;run<BENCH_RUNS;run++) {
+      start=bench_time_us();
+      bench_sink+=bench_method(h,method);
+      long long us=bench_time_us()-start;
+      if (best_us<0||us<best_us) best_us=us;
+    }
+    if (best_us<1) best_us=1;
+    printf("%s,%u,%d,%lld,%lld,%s,%lld,%.1f\n",
+	   file,h->maximumOrder,h->flatNodeCount,
+	   (long long)sizeof(struct context_index_entry)<<h->contextIndexBits,
+	   index_us,bench_methods[method],lookups,best_us*1000.0/lookups);
+  }
+  fflush(stdout);
+  stats_handle_free(h);
+  return 0;
+}
+
+int main(int argc,char **argv)
+{
+  if (argc<2) {
+    fprintf(stderr,"usage: benchmark_contexts <messages> [stats.dat ...]\n");
+    exit(-1);
+  }
+  if (bench_read_messages(argv[1])) exit(-1);
+
+  printf("model,maximum_order,nodes,index_bytes,index_build_us,method,lookups,ns_per_lookup\n");
+  if (argc<3) return bench_model("stats.dat")?-1:0;
+  int i;
+  for(i=2;i<argc;i++) if (bench_model(argv[i])) exit(-1);
+  return 0;
+}
@@ -122,6 +122,7 @@ int FUNC(CaseModel1)(range_coder *c,unsigned short *line,int len,stats_handle *h
 	  range_encode_symbol(c,frequencies,2,upper);
 #else
 	  upper=range_decode_symbol(c,frequencies,2);
+	  if (upper<0) return -1;
 #endif
 	} else {
 	  /* subsequent letter, so can use case of previous letter in model */
@@ -139,6 +140,7 @@ int FUNC(CaseModel1)(range_coder *c,unsigned short *line,int len,stats_handle *h
 	  range_encode_symbol(c,h->caseposn2[lastCase][pos],2,upper);
 #else
 	  upper=range_decode_symbol(c,h->caseposn2[lastCase][pos],2);
+	  if (upper<0) return -1;
 #endif
 	}
 	if (upper==1) line[i]=toupper(line[i]);
@@ -151,7 +153,7 @@ int FUNC(CaseModel1)(range_coder *c,unsigned short *line,int len,stats_handle *h
 	else if (upper==-1) {
 	  fprintf(stderr,"%s(): character processed without determining case.\n",
 		  __FUNCTION__);
-	  exit(-1);
+	  return -1;
 	}
       }
     }    
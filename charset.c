@@ -27,19 +27,29 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 char chars[CHARCOUNT]="abcdefghijklmnopqrstuvwxyz !@#$%^&*()_+-=~`[{]}\\|;:'\"<,>.?/\r\n\t0U";
 char printableChars[PRINTABLECHARCOUNT]="abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ !@#$%^&*()_+-=~`[{]}\\|;:'\"<,>.?/\r\n\t0123456789";
 char wordChars[36]="abcdefghijklmnopqrstuvwxyz0123456789";
+/* Symbol for each ASCII character, looked up by charIdx() for every
+   character of every context */
+signed char charIndexes[0x80];
+
+/* Run as the program starts, so that threads never race to fill in the
+   table */
+void __attribute__((constructor)) charIdx_init()
+{
+  int c,i;
+  for(c=0;c<0x80;c++) {
+    // Collapse digits onto a single position.
+    int cc=(c>='1'&&c<='9')?'0':c;
+    /* Not valid character -- must be encoded separately */
+    charIndexes[c]=-1;
+    for(i=0;i<CHARCOUNT;i++)
+      if (cc==chars[i]) { charIndexes[c]=i; break; }
+  }
+}
+
 int charIdx(unsigned short c)
 {
   if (c>0x7f) c='U';
-
-  // Collapse digits onto a single position.
-  if (c>='1'&&c<='9') c='0';
-
-  int i;
-  for(i=0;i<CHARCOUNT;i++)
-    if (c==chars[i]) return i;
-       
-  /* Not valid character -- must be encoded separately */
-  return -1;
+  return charIndexes[c];
 }
 
 int printableCharIdx(unsigned char c)
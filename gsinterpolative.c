@@ -85,7 +85,7 @@ int ic_encode_recursive(int *list,
 			int max_value,
 			range_coder *c);
 
-void binary_encode(int low,int *pp,int high,range_coder *c)
+int binary_encode(int low,int *pp,int high,range_coder *c)
 {
   /* Work out the range of values we can encode/decode */
   int p=*pp;
@@ -102,12 +102,10 @@ void binary_encode(int low,int *pp,int high,range_coder *c)
     }
 #endif
  
-  range_encode_equiprobable(c,range,value);
-  
-  return;
+  return range_encode_equiprobable(c,range,value);
 }
 
-void binary_decode(int low,int *pp,int high,range_coder *c)
+int binary_decode(int low,int *pp,int high,range_coder *c)
 {
 
   /* Work out the range of values we can encode/decode */
@@ -116,10 +114,10 @@ void binary_decode(int low,int *pp,int high,range_coder *c)
   int value;
 
   value=range_decode_equiprobable(c,range);
+  if (value<0) return -1;
   *pp=value+low;
-
   
-  return;
+  return 0;
 }
 
 #endif
@@ -161,7 +159,7 @@ int ENCODE(ic_,_recursive_r)(int *list,
       /* Encode the document number */
       if (p<list_length)
 	{
-	  ENCODE(binary_,)(doc_low,&list[p],doc_high,c);
+	  if (ENCODE(binary_,)(doc_low,&list[p],doc_high,c)) return -1;
 	  //	  printf("%d [%d,%d,%d] step=%d\n",p,doc_low,list[p],doc_high,step);
 	}
     }
@@ -169,17 +167,17 @@ int ENCODE(ic_,_recursive_r)(int *list,
   if (step>1)
     {
       /* Now recurse left and right children */
-      ENCODE(ic_,_recursive_r)(list,list_length,			       
-			       max_value,
-			       c,
-			       lo,p-(step>>1),p,
-			       step>>1);  
+      if (ENCODE(ic_,_recursive_r)(list,list_length,			       
+				   max_value,
+				   c,
+				   lo,p-(step>>1),p,
+				   step>>1)) return -1;
       
-      ENCODE(ic_,_recursive_r)(list,list_length,
-			       max_value,
-			       c,
-			       p,p+(step>>1),hi,
-			       step>>1);  
+      if (ENCODE(ic_,_recursive_r)(list,list_length,
+				   max_value,
+				   c,
+				   p,p+(step>>1),hi,
+				   step>>1)) return -1;
     }
   
   return 0;
@@ -194,14 +192,13 @@ int ENCODE(ic_,_recursive)(int *list,
   /* Start at largest power of two, and round list size up to next power of two
      to keep recursion simple, and keep bit stream compatible with fast
      interpolative coder. */
+  if (list_length<1) return 0;
   int powerof2=biggest_power_of_2(list_length+1);
   
-  ENCODE(ic_,_recursive_r)(list,list_length,
-			   max_value,
-			   c,
-			   -1,powerof2-1,list_length+1,powerof2); 
-  
-  return 0;
+  return ENCODE(ic_,_recursive_r)(list,list_length,
+				  max_value,
+				  c,
+				  -1,powerof2-1,list_length+1,powerof2); 
 }
 
 
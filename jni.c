@@ -195,13 +195,13 @@ JNIEXPORT jobjectArray JNICALL Java_org_servalproject_succinctdata_jni_xml2succi
 
     LOGI("About to read stats file %s",smacdat_c);
 
-    // Get stats handle
-    stats_handle *h=stats_new_handle(smacdat_c);
+    // Get stats handle.  The model is shared with other callers, and stays
+    // loaded for later messages, so this thread uses a handle of its own.
+    stats_handle *model=stats_open(smacdat_c);
+    stats_handle *h=model?stats_thread_handle(model):NULL;
 
-    stats_load_tree(h);
-    LOGI("Loaded entire stats tree");
-    
     if (!h) {
+      if (model) stats_close(model);
       recipe_free(recipe);
       char message[1024];
       snprintf(message,1024,"Could not read SMAC stats file %s",smacdat_c);
@@ -217,6 +217,7 @@ JNIEXPORT jobjectArray JNICALL Java_org_servalproject_succinctdata_jni_xml2succi
 
     // Clean up after ourselves
     stats_handle_free(h);
+    stats_close(model);
     recipe_free(recipe);
     char filename[1024];
     snprintf(filename,1024,"%s/%s.%s.recipe",path,formname_c,formversion_c);
@@ -32,6 +32,7 @@ int encodeLength(range_coder *c,int len,stats_handle *h)
 
 int decodeLength(range_coder *c,stats_handle *h)
 {
-  int len=range_decode_symbol(c,(unsigned int *)h->messagelengths,1024);
+  int len=range_decode_symbol_indexed(c,(unsigned int *)h->messagelengths,1024,
+				      &h->messagelengths_index);
   return len;
 }
@@ -43,8 +43,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #undef DEBUG
 
-extern long long total_unicode_millibits;
-extern long long total_unicode_chars;
+extern __thread long long total_unicode_millibits;
+extern __thread long long total_unicode_chars;
 
 int strncmp816(char *s1,unsigned short *s2,int len)
 {
@@ -70,6 +70,9 @@ int FUNC(LCAlphaSpace)(range_coder *c,unsigned short *s,int length,stats_handle
   int lastCodePage=0x0080/0x80;
 //  int lastLastCodePage=0x0080/0x80;
   int firstUnicode=1;
+  /* Node for the context so far, followed from character to character
+     when the model allows, rather than searched for each time */
+  unsigned int context=0;
 
   for(o=0;o<length;o++) {
     double previousEntropy=c->entropy;
@@ -77,7 +80,9 @@ int FUNC(LCAlphaSpace)(range_coder *c,unsigned short *s,int length,stats_handle
     int t=s[o];
 #endif
     s[o]=0;
-    struct probability_vector *v=extractVector(s,o,h);
+    struct probability_vector *v=h->flatExt?contextVector(h,context)
+      :extractVector(s,o,h);
+    if (!v) return -1;
 #ifdef ENCODING
     int symbol=charIdx(t);
     //    vectorReport(NULL,v,symbol);
@@ -85,13 +90,16 @@ int FUNC(LCAlphaSpace)(range_coder *c,unsigned short *s,int length,stats_handle
     s[o]=t;
 #else
     int symbol=range_decode_symbol(c,v->v,CHARCOUNT);
+    if (symbol<0) return -1;
     s[o]=chars[symbol];
 #endif
     if (s[o]>='0'&&s[o]<='9') {
 #ifdef ENCODING
       range_encode_equiprobable(c,10,s[o]-'0');
 #else
-      s[o]='0'+range_decode_equiprobable(c,10);
+      int digit=range_decode_equiprobable(c,10);
+      if (digit<0) return -1;
+      s[o]='0'+digit;
 #endif
     } else if (s[o]=='U'||s[o]>0x7f) {
       // unicode character
@@ -120,25 +128,43 @@ int FUNC(LCAlphaSpace)(range_coder *c,unsigned short *s,int length,stats_handle
       total_unicode_millibits+=unicodeEntropy*1000;
       total_unicode_chars++;
 #else
+      /* Each page's statistics are indexed when they are loaded, so that
+	 only the few symbols sharing the target's bucket are searched.
+	 After a page switch only the first 128 symbols can follow, which
+	 the same index covers. */
       if (firstUnicode) {
 	firstUnicode=0;
 	lastCodePage=range_decode_equiprobable(c,511)+1;
+	if (lastCodePage<1) return -1;
 	counts=(unsigned int *)getUnicodeStatistics(h,lastCodePage);
-	symbol=range_decode_symbol(c,counts,128);
+	if (!counts) return -1;
+	symbol=range_decode_symbol_indexed(c,counts,128,
+					   &h->unicode_pages[lastCodePage]->index);
       } else {
-	symbol=range_decode_symbol(c,counts,128+512);      
+	if (!counts) return -1;
+	symbol=range_decode_symbol_indexed(c,counts,128+512,
+					   &h->unicode_pages[lastCodePage]->index);
       }
+      if (symbol<0) return -1;
       if (symbol>127) {
 //	lastLastCodePage=lastCodePage;
 	lastCodePage=symbol-128;
 	unsigned int *counts=(unsigned int *)getUnicodeStatistics(h,lastCodePage);
-	if (counts) symbol=range_decode_symbol(c,counts,128);
+	if (counts)
+	  symbol=range_decode_symbol_indexed(c,counts,128,
+					     &h->unicode_pages[lastCodePage]->index);
 	else return -1;
+	if (symbol<0) return -1;
       } 
       s[o]=lastCodePage*0x80+symbol;
       //      fprintf(stderr,"decoded unicode char: 0x%04x\n",s[o]);
 #endif
     }
+    if (h->flatExt) {
+      context=contextNext(h,context,s[o]);
+      if (h->maximumContext)
+	context=contextTruncate(h,context,h->maximumContext);
+    }
     // Record entropy for this character if requested.
     if (entropyLog) entropyLog[o]=c->entropy-previousEntropy;
   }
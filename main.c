@@ -38,16 +38,16 @@ int lines=0;
 double worstPercent=0,bestPercent=100;
 long long total_compressed_bits=0;
 long long total_uncompressed_bits=0;
-long long total_alpha_bits=0;
-long long total_nonalpha_bits=0;
-long long total_case_bits=0;
-long long total_model_bits=0;
+__thread long long total_alpha_bits=0;
+__thread long long total_nonalpha_bits=0;
+__thread long long total_case_bits=0;
+__thread long long total_model_bits=0;
 long long total_length_millibits=0;
-long long total_finalisation_bits=0;
-long long total_length_bits=0;
+__thread long long total_finalisation_bits=0;
+__thread long long total_length_bits=0;
 
-long long total_unicode_millibits=0;
-long long total_unicode_chars=0;
+__thread long long total_unicode_millibits=0;
+__thread long long total_unicode_chars=0;
 
 long long total_messages=0;
 
@@ -98,12 +98,30 @@ int usage()
 }
 
 char *stats_file="stats.dat";
+#ifdef COMPILED_MODEL
+stats_handle *COMPILED_MODEL();
+#endif
+
+/* Set SMAC_CODER=bytewise or SMAC_CODER=rans to run tests using the
+   byte-oriented or interleaved rANS coders, and SMAC_NOENTROPY to time
+   compression without entropy accounting (the bit breakdown in the
+   summary is then reported as zero).  SMAC_VECTOR_CACHE sets the
+   number of probability vectors kept once they have been worked out,
+   which is otherwise one for every node of the tree. */
+int coder_format=RANGE_FORMAT_BITWISE;
+int coder_noentropy=0;
 
 int main(int argc,char *argv[])
 {
   int i;
 
   if (argc<2) usage();
+
+  if (getenv("SMAC_CODER")&&!strcasecmp(getenv("SMAC_CODER"),"bytewise"))
+    coder_format=RANGE_FORMAT_BYTEWISE;
+  if (getenv("SMAC_CODER")&&!strcasecmp(getenv("SMAC_CODER"),"rans"))
+    coder_format=RANGE_FORMAT_RANS;
+  if (getenv("SMAC_NOENTROPY")) coder_noentropy=1;
   
   /* Clear statistics */
   for(i=0;i<104;i++) {
@@ -116,6 +134,9 @@ int main(int argc,char *argv[])
   // all invocations.
 #ifdef ANDROID
   stats_handle *h=stats_new_handle("/sdcard/servalproject/sam/succinct_recipes/smac.dat");
+#elif defined(COMPILED_MODEL)
+  /* Built with a model from `smac compile', as make test does */
+  stats_handle *h=COMPILED_MODEL();
 #else
   stats_handle *h=stats_new_handle(getenv("SMAC_DAT")?getenv("SMAC_DAT"):stats_file);
 #endif
@@ -124,9 +145,6 @@ int main(int argc,char *argv[])
     exit(-1);
   }
 
-
-  // Load complete tree
-  stats_load_tree(h);
   
   if (!h) {
     char working_dir[1024];
@@ -135,12 +153,52 @@ int main(int argc,char *argv[])
     exit(-1);
   }
 
+  /* Read stats.dat through a cache of SMAC_BLOCK_CACHE bytes instead of
+     mapping it */
+  if (getenv("SMAC_BLOCK_CACHE"))
+    stats_set_block_cache(h,atoi(getenv("SMAC_BLOCK_CACHE")));
+
+  /* Keep the counts of the tree in SMAC_QUANTISED_COUNTS (8 or 16) bits
+     each, to save memory */
+  if (getenv("SMAC_QUANTISED_COUNTS"))
+    stats_set_quantised_counts(h,atoi(getenv("SMAC_QUANTISED_COUNTS")));
+
+  /* Trade compression for speed, with SMAC_LEVEL from 1 (quickest) to 4
+     (the default).  See the STATS_LEVEL_ values in packed_stats.h. */
+  if (getenv("SMAC_LEVEL")) stats_set_level(h,atoi(getenv("SMAC_LEVEL")));
+
+  /* Decode the tree with SMAC_LOAD_THREADS threads when preloading it */
+  if (getenv("SMAC_LOAD_THREADS"))
+    stats_set_load_threads(h,atoi(getenv("SMAC_LOAD_THREADS")));
+
+  /* Preload tree for speed, or with SMAC_LAZY_TREE=<bytes>, decode nodes
+     only as they are needed, keeping that many bytes of them */
+  if (getenv("SMAC_LAZY_TREE"))
+    stats_lazy_tree(h,atoi(getenv("SMAC_LAZY_TREE")));
+  else {
+    stats_load_tree(h);
+    stats_load_unicode(h);
+  }
+  stats_set_vector_cache(h,getenv("SMAC_VECTOR_CACHE")?
+			 atoi(getenv("SMAC_VECTOR_CACHE")):-1);
+  /* With SMAC_CONTEXT_INDEX=1, look up contexts in a hash index rather
+     than walking down the tree for each one.  It needs the whole tree. */
+  if (getenv("SMAC_CONTEXT_INDEX")&&atoi(getenv("SMAC_CONTEXT_INDEX"))
+      &&!getenv("SMAC_LAZY_TREE"))
+    stats_index_contexts(h);
+
   if (argc>1) {
     if (!strcasecmp(argv[1],"recipe")) return recipe_main(argc,argv,h);
   }
-  
-  /* Preload tree for speed */
-  stats_load_tree(h);
+
+  /* Write the model, decoded, to a file that can be used in place of
+     stats.dat by setting SMAC_DAT, and which starts without decoding */
+  if (argc>2&&!strcmp(argv[1],"snapshot"))
+    return stats_write_snapshot(h,argv[2])?-1:0;
+  /* Write the model as C source for linking into the program, with
+     stats_model_new_handle(), or argv[3]_new_handle(), to get at it */
+  if (argc>2&&!strcmp(argv[1],"compile"))
+    return stats_write_tables_c(h,argv[2],argc>3?argv[3]:"stats_model")?-1:0;
 
   if (!strcmp("babble",argv[1])) {
     fprintf(stderr,"You didn't provide me any messages to test, so I'll make some up.\n");
@@ -247,6 +305,8 @@ int processFile(FILE *f,FILE *contentXML,stats_handle *h)
 
     double entropyLog[1025];
     range_coder *c=range_new_coder(2048);
+    c->format=coder_format;
+    c->noentropy=coder_noentropy;
     now = current_time_us();
     stats3_compress_bits(c,(unsigned char *)m,strlen(m),h,entropyLog);
     stats3_compress_us+=current_time_us()-now;
@@ -44,18 +44,21 @@ int decodeNonAlpha(range_coder *c,int nonAlphaPositions[],
 {
   int i;
   int containsNonAlpha=range_decode_symbol(c,&probNoNonAlpha,2);
+  if (containsNonAlpha<0) return -1;
   if (containsNonAlpha) {    
     int count=range_decode_equiprobable(c,messageLength+1);
+    if (count<0) return -1;
     
     // printf("Decoding %d non-alpha characters.\n",count);
 
     /* Decode the positions of special characters */
-    ic_decode_recursive(nonAlphaPositions,count,messageLength,c);
+    if (ic_decode_recursive(nonAlphaPositions,count,messageLength,c)) return -1;
     
     /* Decode the characters */
     for(i=0;i<count;i++) {
       nonAlphaValues[i]=range_decode_equiprobable(c,256); 
     }    
+    if (c->errors) return -1;
 
     // for(i=0;i<count;i++)
     //   printf("  nonalpha char #%d @ %d = 0x%02x\n",i,nonAlphaPositions[i],nonAlphaValues[i]);
@@ -17,11 +17,17 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <math.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "arithmetic.h"
 #include "charset.h"
@@ -52,17 +58,414 @@ void stats_handle_free(stats_handle *h)
 {
   if (h->mmap) munmap(h->mmap,h->fileLength);
   if (h->buffer) free(h->buffer);
-  if (h->bufferBitmap) free(h->bufferBitmap);
+  if (h->blocks) free(h->blocks);
+  if (h->blockSlots) free(h->blockSlots);
   if (h->tree) node_free_recursive(h->tree);
+  if (h->vectorCache) free(h->vectorCache);
+  if (h->lazyNodes) free(h->lazyNodes);
+  if (h->lazyHash) free(h->lazyHash);
+  if (h->contextIndex&&!h->contextIndexShared) free(h->contextIndex);
 
+  /* A snapshot's tables are part of its mapping, and a thread handle's
+     belong to the model */
   int i;
-  for(i=0;i<512;i++) if (h->unicode_pages[i]) free(h->unicode_pages[i]);
+  if (!h->sharedTables) {
+    if (h->flat) free(h->flat);
+    if (h->flatCounts) free(h->flatCounts);
+    if (h->flatQuantised) free(h->flatQuantised);
+    if (h->flatExt) free(h->flatExt);
+    for(i=0;i<512;i++)
+      if (h->unicode_pages[i]&&h->unicode_pages[i]!=h->unicodeDefaultPage)
+	free(h->unicode_pages[i]);
+    if (h->unicodeDefaultPage) free(h->unicodeDefaultPage);
+  }
   if (h->unicode_page_addresses) free(h->unicode_page_addresses);
 
   free(h);
   return;
 }
 
+/* Point the handle at the decoded tables of a model, which are used in
+   place.  The handle must have been created with sharedTables set, so that
+   the tables are not freed with it. */
+int stats_use_tables(stats_handle *h,const struct stats_tables *t)
+{
+  const struct stats_snapshot_header *s=t->header;
+  int i;
+
+  h->totalCount=s->totalCount;
+  h->maximumOrder=s->maximumOrder;
+  bcopy(s->casestartofmessage,h->casestartofmessage,
+	sizeof(h->casestartofmessage));
+  bcopy(s->casestartofword2,h->casestartofword2,sizeof(h->casestartofword2));
+  bcopy(s->casestartofword3,h->casestartofword3,sizeof(h->casestartofword3));
+  bcopy(s->caseposn1,h->caseposn1,sizeof(h->caseposn1));
+  bcopy(s->caseposn2,h->caseposn2,sizeof(h->caseposn2));
+  bcopy(s->messagelengths,h->messagelengths,sizeof(h->messagelengths));
+  bcopy(&s->messagelengths_index,&h->messagelengths_index,
+	sizeof(h->messagelengths_index));
+
+  /* The tables are only ever read */
+  h->flat=(struct flat_node *)t->flat;
+  h->flatCounts=(unsigned int *)t->flatCounts;
+  h->flatExt=s->flatExtCount?(unsigned int *)t->flatExt:NULL;
+  h->flatExtCount=s->flatExtCount;
+  h->flatNodeCount=s->flatNodeCount;
+  h->flatCountCount=s->flatCountCount;
+  h->vectors=(struct probability_vector *)t->vectors;
+  for(i=1;i<512;i++)
+    h->unicode_pages[i]=(struct unicode_page_statistics *)t->unicodePages[i];
+  return 0;
+}
+
+/* Handle for a model compiled into the program by `smac compile', which
+   needs neither a file nor decoding */
+stats_handle *stats_compiled_handle(const struct stats_tables *t)
+{
+  if (t->header->charCount!=CHARCOUNT
+      ||t->header->flatNodeSize!=sizeof(struct flat_node)) {
+    fprintf(stderr,"Compiled model is for a different build.\n");
+    return NULL;
+  }
+  stats_handle *h=calloc(sizeof(stats_handle),1);
+  if (!h) return NULL;
+  h->sharedTables=1;
+  h->vectorCacheLimit=STATS_VECTOR_CACHE_DEFAULT;
+  h->modelId=-1;
+  stats_use_tables(h,t);
+  return h;
+}
+
+/* Handle for one thread to use a model that other threads are using at
+   the same time.  The model is loaded completely first, so that looking
+   things up in it never changes it, and the new handle shares all of its
+   tables, with only its own scratch space and vector cache.  Loading is
+   not thread safe, so create the handles before starting the threads,
+   and free them before the model. */
+stats_handle *stats_thread_handle(stats_handle *model)
+{
+  if (stats_load_tree(model)||stats_load_unicode(model)) return NULL;
+
+  stats_handle *h=malloc(sizeof(stats_handle));
+  if (!h) return NULL;
+  bcopy(model,h,sizeof(stats_handle));
+  h->sharedTables=1;
+  /* Everything else that the model allocated is its own */
+  h->file=NULL;
+  h->mmap=NULL;
+  h->buffer=NULL;
+  h->blocks=NULL;
+  h->blockSlots=NULL;
+  h->unicode_page_addresses=NULL;
+  h->unicodeDefaultPage=NULL;
+  h->vectorCache=NULL;
+  h->vectorCacheSize=0;
+  h->lazyNodes=NULL;
+  h->lazyHash=NULL;
+  h->contextIndexShared=1;
+  return h;
+}
+
+/* Models opened through stats_open(), so that each file is only loaded
+   once however many callers use it.  Files are told apart by device and
+   inode, so that different paths to the same file share it too.  A model
+   is kept when it is closed for the last time, in case it is opened again
+   for the next message, until stats_flush_models() is called. */
+struct stats_model {
+  dev_t device;
+  ino_t inode;
+  int modelId;
+  int references;
+  stats_handle *h;
+  struct stats_model *next;
+};
+struct stats_model *stats_models=NULL;
+pthread_mutex_t stats_models_lock=PTHREAD_MUTEX_INITIALIZER;
+
+struct stats_model *stats_model_with_id(int modelId)
+{
+  struct stats_model *m;
+  for(m=stats_models;m;m=m->next) if (m->modelId==modelId) return m;
+  return NULL;
+}
+
+/* Open a model for sharing, with an ID that stats3_compress_tagged()
+   writes in each message so that stats3_decompress_tagged() can find the
+   model again, or -1 for none.  The model is loaded completely first, so
+   that it never changes after it is returned, and any thread can use it
+   through a handle of its own from stats_thread_handle().  The handle
+   must be released with stats_close() rather than stats_handle_free(). */
+stats_handle *stats_open_model(char *file,int modelId)
+{
+  struct stat st;
+  struct stats_model *m;
+  stats_handle *h=NULL;
+
+  if (modelId<-1||modelId>STATS_MODEL_ID_MAX) {
+    fprintf(stderr,"Model ID %d is not between 0 and %d.\n",
+	    modelId,STATS_MODEL_ID_MAX);
+    return NULL;
+  }
+  if (stat(file,&st)) {
+    fprintf(stderr,"Could not open model %s: %s\n",file,strerror(errno));
+    return NULL;
+  }
+
+  pthread_mutex_lock(&stats_models_lock);
+  for(m=stats_models;m;m=m->next)
+    if (m->device==st.st_dev&&m->inode==st.st_ino) break;
+  if (modelId>=0&&(!m||m->modelId!=modelId)) {
+    if (m&&m->modelId>=0) {
+      fprintf(stderr,"Model %s is already open with ID %d.\n",
+	      file,m->modelId);
+      goto done;
+    }
+    if (stats_model_with_id(modelId)) {
+      fprintf(stderr,"Model ID %d is already used by another model.\n",
+	      modelId);
+      goto done;
+    }
+  }
+
+  if (!m) {
+    m=calloc(sizeof(struct stats_model),1);
+    if (!m) goto done;
+    m->h=stats_new_handle(file);
+    if (!m->h||stats_load_tree(m->h)||stats_load_unicode(m->h)) {
+      fprintf(stderr,"Could not load model %s\n",file);
+      if (m->h) stats_handle_free(m->h);
+      free(m);
+      goto done;
+    }
+    m->device=st.st_dev;
+    m->inode=st.st_ino;
+    m->modelId=-1;
+    m->next=stats_models;
+    stats_models=m;
+  }
+  /* A model opened without an ID can be given one later */
+  if (modelId>=0) m->modelId=m->h->modelId=modelId;
+  m->references++;
+  h=m->h;
+
+ done:
+  pthread_mutex_unlock(&stats_models_lock);
+  return h;
+}
+
+stats_handle *stats_open(char *file)
+{
+  return stats_open_model(file,-1);
+}
+
+/* Release a handle returned by stats_open() or stats_open_model() */
+int stats_close(stats_handle *h)
+{
+  struct stats_model *m;
+  int r=-1;
+
+  pthread_mutex_lock(&stats_models_lock);
+  for(m=stats_models;m;m=m->next)
+    if (m->h==h) {
+      if (m->references>0) {
+	m->references--;
+	r=0;
+      }
+      break;
+    }
+  pthread_mutex_unlock(&stats_models_lock);
+  if (r) fprintf(stderr,"stats_close() called for a model that is not open.\n");
+  return r;
+}
+
+/* Each thread's own handles for the models in the registry, made by
+   stats_thread_model() as it first needs them.  Each holds a reference
+   to its model, which is released when the thread exits. */
+struct stats_thread_models {
+  stats_handle *h[STATS_MODEL_ID_MAX+1];
+  stats_handle *model[STATS_MODEL_ID_MAX+1];
+};
+pthread_key_t stats_thread_models_key;
+pthread_once_t stats_thread_models_once=PTHREAD_ONCE_INIT;
+
+void stats_thread_models_free(void *p)
+{
+  struct stats_thread_models *t=p;
+  int i;
+  for(i=0;i<=STATS_MODEL_ID_MAX;i++)
+    if (t->h[i]) {
+      stats_handle_free(t->h[i]);
+      stats_close(t->model[i]);
+    }
+  free(t);
+}
+
+void stats_thread_models_init()
+{
+  pthread_key_create(&stats_thread_models_key,stats_thread_models_free);
+}
+
+/* This thread's handle for the open model with the given ID, or NULL if
+   there is none.  The handle is the thread's own, as from
+   stats_thread_handle(), so threads can decode with the same model at
+   once.  It belongs to the registry, and must not be freed. */
+stats_handle *stats_thread_model(int modelId)
+{
+  struct stats_thread_models *t;
+  struct stats_model *m;
+  stats_handle *model=NULL;
+
+  if (modelId<0||modelId>STATS_MODEL_ID_MAX) return NULL;
+  pthread_once(&stats_thread_models_once,stats_thread_models_init);
+  t=pthread_getspecific(stats_thread_models_key);
+  if (t&&t->h[modelId]) return t->h[modelId];
+  if (!t) {
+    t=calloc(sizeof(struct stats_thread_models),1);
+    if (!t) return NULL;
+    pthread_setspecific(stats_thread_models_key,t);
+  }
+
+  pthread_mutex_lock(&stats_models_lock);
+  m=stats_model_with_id(modelId);
+  if (m&&m->references>0) {
+    m->references++;
+    model=m->h;
+  }
+  pthread_mutex_unlock(&stats_models_lock);
+  if (!model) return NULL;
+
+  /* The model is already loaded, so this only reads it */
+  t->h[modelId]=stats_thread_handle(model);
+  if (!t->h[modelId]) {
+    stats_close(model);
+    return NULL;
+  }
+  t->model[modelId]=model;
+  return t->h[modelId];
+}
+
+/* Free the models that are no longer open, and return how many there
+   were */
+int stats_flush_models()
+{
+  struct stats_model **m=&stats_models;
+  int freed=0;
+
+  pthread_mutex_lock(&stats_models_lock);
+  while(*m) {
+    struct stats_model *o=*m;
+    if (o->references) {
+      m=&o->next;
+      continue;
+    }
+    *m=o->next;
+    stats_handle_free(o->h);
+    free(o);
+    freed++;
+  }
+  pthread_mutex_unlock(&stats_models_lock);
+  return freed;
+}
+
+/* Check that every link between the tables of the flattened tree stays
+   within them, so that a damaged snapshot cannot make lookups read
+   outside the mapping.  Parents come before their children, so following
+   them always reaches the root. */
+int stats_check_flat_tables(stats_handle *h)
+{
+  int i,c;
+
+  for(i=0;i<h->flatNodeCount;i++) {
+    struct flat_node *n=&h->flat[i];
+    unsigned int children=0,counts=0,links=0;
+    for(c=0;c<FLAT_BITMAP_WORDS;c++) {
+      children+=__builtin_popcount(n->childBits[c]);
+      counts+=__builtin_popcount(n->countBits[c]);
+      links+=__builtin_popcount(n->extBits[c]);
+    }
+    if ((children&&n->firstChild+(long long)children>h->flatNodeCount)
+	||(counts&&n->firstCount+(long long)counts>h->flatCountCount)
+	||(links&&(!h->flatExt
+		   ||n->firstExt+(long long)links>h->flatExtCount))
+	||(i&&n->parent>=i)) {
+      fprintf(stderr,"Node %d of the flattened tree links outside it.\n",i);
+      return -1;
+    }
+  }
+  for(i=0;i<h->flatExtCount;i++)
+    if (h->flatExt[i]>=h->flatNodeCount) {
+      fprintf(stderr,"Context link %d leads outside the flattened tree.\n",i);
+      return -1;
+    }
+  return 0;
+}
+
+/* Map a snapshot written by stats_write_snapshot(), and point the handle
+   at the tables in it.  If it cannot be mapped, it is read in whole. */
+int stats_map_snapshot(stats_handle *h)
+{
+  struct stats_snapshot_header *s;
+  unsigned char *base;
+  int i;
+
+  h->sharedTables=1;
+  h->mmap=mmap(NULL,h->fileLength,PROT_READ,MAP_SHARED,fileno(h->file),0);
+  if (h->mmap!=MAP_FAILED) base=h->mmap;
+  else {
+    h->mmap=NULL;
+    h->buffer=malloc(h->fileLength);
+    fseek(h->file,0,SEEK_SET);
+    if (!h->buffer||fread(h->buffer,h->fileLength,1,h->file)!=1) {
+      fprintf(stderr,"Could not read model snapshot\n");
+      return -1;
+    }
+    base=h->buffer;
+  }
+
+#define FITS(OFFSET,BYTES) ((OFFSET)+(long long)(BYTES)<=h->fileLength)
+  s=(struct stats_snapshot_header *)base;
+  if (!FITS(0,sizeof(*s))
+      ||s->byteOrder!=STATS_SNAPSHOT_BYTE_ORDER||s->charCount!=CHARCOUNT
+      ||s->headerSize!=sizeof(*s)||s->flatNodeSize!=sizeof(struct flat_node)
+      ||s->fileLength!=h->fileLength) {
+    fprintf(stderr,"Model snapshot is truncated, or was written for a different build.\n");
+    return -1;
+  }
+  int ok=s->flatNodeCount>0
+    &&FITS(s->flatOffset,sizeof(struct flat_node)*s->flatNodeCount)
+    &&FITS(s->flatCountsOffset,sizeof(unsigned int)*s->flatCountCount)
+    &&FITS(s->flatExtOffset,sizeof(unsigned int)*s->flatExtCount)
+    &&FITS(s->vectorsOffset,
+	   sizeof(struct probability_vector)*s->flatNodeCount);
+  for(i=1;i<512;i++)
+    if (!FITS(s->unicodePageOffsets[i],sizeof(struct unicode_page_statistics)))
+      ok=0;
+  if (!ok) {
+    fprintf(stderr,"Model snapshot is corrupt.\n");
+    return -1;
+  }
+#undef FITS
+
+  struct stats_tables t;
+  t.header=s;
+  t.flat=(struct flat_node *)&base[s->flatOffset];
+  t.flatCounts=(unsigned int *)&base[s->flatCountsOffset];
+  t.flatExt=(unsigned int *)&base[s->flatExtOffset];
+  t.vectors=(struct probability_vector *)&base[s->vectorsOffset];
+  t.unicodePages[0]=NULL;
+  for(i=1;i<512;i++)
+    t.unicodePages[i]=(struct unicode_page_statistics *)
+      &base[s->unicodePageOffsets[i]];
+  stats_use_tables(h,&t);
+  if (stats_check_flat_tables(h)) {
+    fprintf(stderr,"Model snapshot is corrupt.\n");
+    return -1;
+  }
+
+  fprintf(stderr,"Mapped model snapshot (%d nodes).\n",h->flatNodeCount);
+  return 0;
+}
+
 unsigned int read24bits(FILE *f)
 {
   int i;
@@ -75,6 +478,8 @@ stats_handle *stats_new_handle(char *file)
 {
   int i,j;
   stats_handle *h=calloc(sizeof(stats_handle),1);
+  h->vectorCacheLimit=STATS_VECTOR_CACHE_DEFAULT;
+  h->modelId=-1;
   h->file=fopen(file,"r");
   if(!h->file) {
     free(h);
@@ -85,6 +490,18 @@ stats_handle *stats_new_handle(char *file)
   fseek(h->file,0,SEEK_END);
   h->fileLength=ftello(h->file);
 
+  /* A snapshot is used as it is */
+  char magic[4];
+  fseek(h->file,0,SEEK_SET);
+  if (fread(magic,4,1,h->file)==1
+      &&!memcmp(magic,STATS_SNAPSHOT_MAGIC,4)) {
+    if (stats_map_snapshot(h)) {
+      stats_handle_free(h);
+      return NULL;
+    }
+    return h;
+  }
+
   fseek(h->file,4,SEEK_SET);
   for(i=0;i<4;i++) h->rootNodeAddress=(h->rootNodeAddress<<8)
 		     |(unsigned char)fgetc(h->file);
@@ -121,41 +538,890 @@ stats_handle *stats_new_handle(char *file)
       h->caseposn2[j][i][0]=read24bits(h->file);
       CHECK(caseposn2[j][i][0]);
     }
-  /* Read in message length stats */
-  {
-    /* 1024 x 24 bit values interpolative coded cannot
-       exceed 4KB (typically around 1.3KB) */
-    int tally=read24bits(h->file);
-    range_coder *c=range_new_coder(4096);
-    fread(c->bit_stream,4096,1,h->file);
-    c->bit_stream_length=4096*8;
-    c->low=0; c->high=0;
-    range_decode_prefetch(c);
-    ic_decode_recursive(h->messagelengths,1024,tally,c);
-    range_coder_free(c);
-    for(i=0;i<1024;i++) 
-      h->messagelengths[i]=h->messagelengths[i]*1.0*0xffffff/tally;
+  /* Read in message length stats */
+  {
+    /* 1024 x 24 bit values interpolative coded cannot
+       exceed 4KB (typically around 1.3KB) */
+    int tally=read24bits(h->file);
+    range_coder *c=range_new_coder(4096);
+    fread(c->bit_stream,4096,1,h->file);
+    c->bit_stream_length=4096*8;
+    c->low=0; c->high=0;
+    range_decode_prefetch(c);
+    ic_decode_recursive(h->messagelengths,1024,tally,c);
+    range_coder_free(c);
+    for(i=0;i<1024;i++) 
+      h->messagelengths[i]=h->messagelengths[i]*1.0*0xffffff/tally;
+    range_build_frequency_index(&h->messagelengths_index,
+				(unsigned int *)h->messagelengths,1024);
+  }
+  fprintf(stderr,"Read case and message length statistics.\n");
+
+  /* Try to mmap() */
+  h->mmap=mmap(NULL, h->fileLength, PROT_READ, MAP_SHARED, fileno(h->file), 0);
+  if (h->mmap!=MAP_FAILED) return h;
+  
+  /* mmap failed, so read parts of the file as they are needed */
+  h->mmap=NULL;
+  h->blockCacheBytes=STATS_BLOCK_CACHE_DEFAULT;
+  return h;
+}
+
+/* Read stats.dat through a cache of at most about bytes, evicting the
+   least recently used blocks, instead of mapping it.  This is what
+   happens anyway if the file cannot be mapped, and can also be used
+   where mapping it is slow, or to bound memory use. */
+int stats_set_block_cache(stats_handle *h,int bytes)
+{
+  /* Snapshots are only ever used mapped, or read in whole */
+  if (h->sharedTables) return -1;
+
+  if (h->mmap) munmap(h->mmap,h->fileLength);
+  h->mmap=NULL;
+  if (h->blocks) free(h->blocks);
+  if (h->blockSlots) free(h->blockSlots);
+  h->blocks=NULL;
+  h->blockSlots=NULL;
+  h->blockCacheBytes=bytes;
+  return 0;
+}
+
+int stats_block_cache_init(stats_handle *h)
+{
+  int fileBlocks=h->fileLength/STATS_BLOCK_SIZE+1;
+  int count=h->blockCacheBytes/(int)sizeof(struct stats_block);
+  int i;
+
+  if (count<1) count=1;
+  /* No point in more entries than there are blocks */
+  if (count>fileBlocks) count=fileBlocks;
+  h->blocks=malloc(sizeof(struct stats_block)*count);
+  h->blockSlots=malloc(sizeof(int)*fileBlocks);
+  if (!h->blocks||!h->blockSlots) {
+    fprintf(stderr,"Could not allocate cache of %d blocks\n",count);
+    if (h->blocks) free(h->blocks);
+    if (h->blockSlots) free(h->blockSlots);
+    h->blocks=NULL; h->blockSlots=NULL;
+    return -1;
+  }
+  for(i=0;i<fileBlocks;i++) h->blockSlots[i]=-1;
+  h->blockCount=count;
+  h->blocksUsed=0;
+  h->blockNewest=-1;
+  h->blockOldest=-1;
+  return 0;
+}
+
+static inline void block_unlink(stats_handle *h,int i)
+{
+  struct stats_block *b=&h->blocks[i];
+  if (b->newer>=0) h->blocks[b->newer].older=b->older;
+  else h->blockNewest=b->older;
+  if (b->older>=0) h->blocks[b->older].newer=b->newer;
+  else h->blockOldest=b->newer;
+}
+
+static inline void block_make_newest(stats_handle *h,int i)
+{
+  struct stats_block *b=&h->blocks[i];
+  b->older=h->blockNewest;
+  b->newer=-1;
+  if (h->blockNewest>=0) h->blocks[h->blockNewest].newer=i;
+  else h->blockOldest=i;
+  h->blockNewest=i;
+}
+
+static inline void block_make_oldest(stats_handle *h,int i)
+{
+  struct stats_block *b=&h->blocks[i];
+  b->newer=h->blockOldest;
+  b->older=-1;
+  if (h->blockOldest>=0) h->blocks[h->blockOldest].older=i;
+  else h->blockNewest=i;
+  h->blockOldest=i;
+}
+
+/* Return the cache entry holding block of the file, reading it in if it
+   is not there, or NULL if the file cannot be read */
+struct stats_block *stats_get_block(stats_handle *h,int block)
+{
+  int i=h->blockSlots[block];
+
+  if (i>=0) {
+    if (h->blockNewest!=i) {
+      block_unlink(h,i);
+      block_make_newest(h,i);
+    }
+    return &h->blocks[i];
+  }
+
+  if (h->blocksUsed<h->blockCount) i=h->blocksUsed++;
+  else {
+    i=h->blockOldest;
+    block_unlink(h,i);
+    if (h->blocks[i].block>=0) h->blockSlots[h->blocks[i].block]=-1;
+  }
+
+  struct stats_block *b=&h->blocks[i];
+  int want=sizeof(b->data);
+  int got=0;
+  off_t offset=(off_t)block*STATS_BLOCK_SIZE;
+  while(got<want) {
+    ssize_t r=pread(fileno(h->file),&b->data[got],want-got,offset+got);
+    if (r<0&&errno==EINTR) continue;
+    if (r<0) {
+      fprintf(stderr,"Could not read block %d of stats file: %s\n",
+	      block,strerror(errno));
+      /* Hand the slot back empty, so that it is the next to be reused */
+      b->block=-1;
+      block_make_oldest(h,i);
+      return NULL;
+    }
+    if (!r) break;
+    got+=r;
+  }
+  /* Past the end of the file reads as zeroes */
+  bzero(&b->data[got],want-got);
+
+  b->block=block;
+  h->blockSlots[block]=i;
+  block_make_newest(h,i);
+  return b;
+}
+
+/* These are static so that they can be inlined when built with -fPIC */
+static inline int flat_bit(unsigned int *bits,int i)
+{
+  return (bits[i>>5]>>(i&31))&1;
+}
+
+/* Number of bits set below bit i */
+static inline int flat_rank(unsigned int *bits,int i)
+{
+  int w,rank=0;
+  for(w=0;w<(i>>5);w++) rank+=__builtin_popcount(bits[w]);
+  if (i&31) rank+=__builtin_popcount(bits[i>>5]&(0xffffffff>>(32-(i&31))));
+  return rank;
+}
+
+/* Quantised counts are kept like small floating point numbers: counts
+   below 1<<mantissaBits as they are, and larger ones as an exponent and
+   the mantissaBits bits that follow the leading one, rounded to nearest.
+   Each is then within one part in 2<<mantissaBits of the count. */
+#define QUANTISED_MANTISSA_BITS(bits) ((bits)==8?3:11)
+
+static inline unsigned int stats_dequantise(unsigned int q,int mantissaBits)
+{
+  unsigned int e=q>>mantissaBits;
+  unsigned int f=q&((1<<mantissaBits)-1);
+  if (!e) return f;
+  return ((1<<mantissaBits)+f)<<(e-1);
+}
+
+unsigned int stats_quantise(unsigned int count,int mantissaBits)
+{
+  if (count<(1U<<mantissaBits)) return count;
+  unsigned int e=1;
+  while((count>>(e-1))>=(2U<<mantissaBits)) e++;
+  unsigned int f=count>>(e-1);
+  if (e>1&&(count>>(e-2))&1) f++;
+  if (f==(2U<<mantissaBits)) { f>>=1; e++; }
+  return (e<<mantissaBits)|(f-(1U<<mantissaBits));
+}
+
+/* Count i of h->flatCounts, whether or not it has been quantised */
+static inline unsigned int flat_count(stats_handle *h,int i)
+{
+  if (!h->quantisedBits) return h->flatCounts[i];
+  if (h->quantisedBits==8)
+    return stats_dequantise(((unsigned char *)h->flatQuantised)[i],
+			    QUANTISED_MANTISSA_BITS(8));
+  return stats_dequantise(((unsigned short *)h->flatQuantised)[i],
+			  QUANTISED_MANTISSA_BITS(16));
+}
+
+int stats_flatten_size(struct node *n,int *nodes,int *counts)
+{
+  int i;
+  (*nodes)++;
+  for(i=0;i<CHARCOUNT;i++) {
+    if (n->counts[i]) (*counts)++;
+    if (n->children[i]) stats_flatten_size(n->children[i],nodes,counts);
+  }
+  return 0;
+}
+
+/* Store n at index, then allocate a block for its children, and store each
+   of them in turn.  Nodes therefore lie in the order that a search moves
+   down the tree. */
+int stats_flatten_node(stats_handle *h,struct node *n,int index,
+		       int *nextNode,int *nextCount)
+{
+  struct flat_node *f=&h->flat[index];
+  int i,children=0;
+
+  f->count=n->count;
+  f->firstCount=*nextCount;
+  for(i=0;i<CHARCOUNT;i++) {
+    if (n->counts[i]) {
+      f->countBits[i>>5]|=1<<(i&31);
+      h->flatCounts[(*nextCount)++]=n->counts[i];
+    }
+    if (n->children[i]) {
+      f->childBits[i>>5]|=1<<(i&31);
+      children++;
+    }
+  }
+
+  f->firstChild=*nextNode;
+  (*nextNode)+=children;
+  children=0;
+  for(i=0;i<CHARCOUNT;i++)
+    if (n->children[i])
+      stats_flatten_node(h,n->children[i],h->flat[index].firstChild+children++,
+			 nextNode,nextCount);
+  return 0;
+}
+
+/* Fill in the parent of every node, and the links from each node to the
+   nodes that add a newer character to its context.  The node for
+   context xc, where c is the newest character, is linked from the node
+   for x.  If a node exists for xc but not for x, the contexts cannot be
+   followed this way, and flatExt is left NULL. */
+int stats_link_contexts(stats_handle *h)
+{
+  int n=h->flatNodeCount;
+  /* For each node, the node with its context less the newest character,
+     and that character */
+  int *older=malloc(sizeof(int)*n);
+  unsigned char *newest=malloc(n);
+  int i,c,links=0;
+
+  if (!older||!newest) {
+    if (older) free(older);
+    if (newest) free(newest);
+    return -1;
+  }
+
+  /* Parents come before their children, so walk down the tree in order */
+  for(i=0;i<n;i++) {
+    struct flat_node *f=&h->flat[i];
+    int child=f->firstChild;
+    for(c=0;c<CHARCOUNT;c++) {
+      if (!flat_bit(f->childBits,c)) continue;
+      h->flat[child].parent=i;
+      if (!i) {
+	older[child]=0;
+	newest[child]=c;
+      } else {
+	struct flat_node *o=older[i]<0?NULL:&h->flat[older[i]];
+	if (o&&flat_bit(o->childBits,c))
+	  older[child]=o->firstChild+flat_rank(o->childBits,c);
+	else older[child]=-1;
+	newest[child]=newest[i];
+      }
+      child++;
+    }
+  }
+
+  for(i=1;i<n;i++) {
+    if (older[i]<0) break;
+    struct flat_node *o=&h->flat[older[i]];
+    o->extBits[newest[i]>>5]|=1<<(newest[i]&31);
+    links++;
+  }
+  if (i<n) {
+    fprintf(stderr,"Contexts cannot be followed incrementally in this model\n");
+    for(i=0;i<n;i++) bzero(h->flat[i].extBits,sizeof(h->flat[i].extBits));
+    free(older); free(newest);
+    return 0;
+  }
+
+  h->flatExt=malloc(sizeof(unsigned int)*(links?links:1));
+  if (!h->flatExt) {
+    free(older); free(newest);
+    return -1;
+  }
+  h->flatExtCount=links;
+  links=0;
+  for(i=0;i<n;i++) {
+    h->flat[i].firstExt=links;
+    for(c=0;c<FLAT_BITMAP_WORDS;c++)
+      links+=__builtin_popcount(h->flat[i].extBits[c]);
+  }
+  for(i=1;i<n;i++) {
+    struct flat_node *o=&h->flat[older[i]];
+    h->flatExt[o->firstExt+flat_rank(o->extBits,newest[i])]=i;
+  }
+  free(older); free(newest);
+  return 0;
+}
+
+/* Replace h->flatCounts with the same counts quantised to
+   h->quantisedBits bits each */
+int stats_quantise_counts(stats_handle *h)
+{
+  int bytes=h->quantisedBits/8;
+  int mantissaBits=QUANTISED_MANTISSA_BITS(h->quantisedBits);
+  int i;
+
+  h->flatQuantised=malloc(bytes*(h->flatCountCount?h->flatCountCount:1));
+  if (!h->flatQuantised) {
+    fprintf(stderr,"Could not allocate %d quantised counts\n",
+	    h->flatCountCount);
+    return -1;
+  }
+  for(i=0;i<h->flatCountCount;i++) {
+    unsigned int q=stats_quantise(h->flatCounts[i],mantissaBits);
+    if (bytes==1) ((unsigned char *)h->flatQuantised)[i]=q;
+    else ((unsigned short *)h->flatQuantised)[i]=q;
+  }
+  free(h->flatCounts);
+  h->flatCounts=NULL;
+  return 0;
+}
+
+int stats_flatten_tree(stats_handle *h)
+{
+  int nodes=0,counts=0;
+  stats_flatten_size(h->tree,&nodes,&counts);
+
+  h->flat=calloc(sizeof(struct flat_node),nodes);
+  h->flatCounts=calloc(sizeof(unsigned int),counts?counts:1);
+  if (!h->flat||!h->flatCounts) {
+    fprintf(stderr,"Could not allocate flattened tree of %d nodes\n",nodes);
+    return -1;
+  }
+  h->flatNodeCount=nodes;
+  h->flatCountCount=counts;
+
+  int nextNode=1,nextCount=0;
+  if (stats_flatten_node(h,h->tree,0,&nextNode,&nextCount)) return -1;
+  if (h->quantisedBits&&stats_quantise_counts(h)) return -1;
+  return stats_link_contexts(h);
+}
+
+/* Set the number of vectors that extractVector() keeps, instead of
+   STATS_VECTOR_CACHE_DEFAULT.  0 turns off the cache, and -1 keeps a
+   vector for every node of the tree, which is fastest but costs several
+   times as much memory as the tree itself. */
+int stats_set_vector_cache(stats_handle *h,int entries)
+{
+  if (h->vectorCache) free(h->vectorCache);
+  h->vectorCache=NULL;
+  h->vectorCacheSize=0;
+  h->vectorCacheLimit=entries;
+  return 0;
+}
+
+int stats_vector_cache_init(stats_handle *h)
+{
+  int size=h->flatNodeCount;
+  if (h->vectorCacheLimit>0&&h->vectorCacheLimit<size) size=h->vectorCacheLimit;
+  /* Pages of the cache are only touched once a node in them is used */
+  h->vectorCache=calloc(sizeof(vector_cache),size);
+  if (!h->vectorCache) {
+    fprintf(stderr,"Could not allocate cache of %d probability vectors\n",size);
+    h->vectorCacheLimit=0;
+    return -1;
+  }
+  h->vectorCacheSize=size;
+  return 0;
+}
+
+/* Keep the counts of the tree in 8 or 16 bits each when it is loaded,
+   instead of 32, to save memory at some cost in compression.  0 keeps
+   them exact. */
+int stats_set_quantised_counts(stats_handle *h,int bits)
+{
+  if (bits!=0&&bits!=8&&bits!=16) {
+    fprintf(stderr,"Counts can only be quantised to 8 or 16 bits\n");
+    return -1;
+  }
+  if (h->flat) {
+    fprintf(stderr,"Counts must be quantised before the tree is loaded\n");
+    return -1;
+  }
+  h->quantisedBits=bits;
+  return 0;
+}
+
+/* Set how much compression to trade for speed.  STATS_LEVEL_DEFAULT
+   uses everything the model has, and is what a new handle does.
+   STATS_LEVEL_MODEL_ONLY codes the same way, but does not also try packed
+   ASCII for each message.  STATS_LEVEL_CONTEXT_LESS_2 also limits
+   contexts to two characters less than the model's order, and
+   STATS_LEVEL_CONTEXT_LESS_3 to three less.  stats3_decompress() decodes
+   a message with the contexts it was coded with, whatever the level of
+   the handle, but the _bits() and _append() functions leave it to the
+   caller to use the same level for both. */
+int stats_set_level(stats_handle *h,int level)
+{
+  if (level<STATS_LEVEL_CONTEXT_LESS_3||level>STATS_LEVEL_DEFAULT) {
+    fprintf(stderr,"Compression level must be from %d to %d\n",
+	    STATS_LEVEL_CONTEXT_LESS_3,STATS_LEVEL_DEFAULT);
+    return -1;
+  }
+  h->noPackedASCIITrial=level<STATS_LEVEL_DEFAULT;
+  return stats_shorten_context(h,level==STATS_LEVEL_CONTEXT_LESS_3?3:
+			       level==STATS_LEVEL_CONTEXT_LESS_2?2:0);
+}
+
+/* Limit contexts to shorter characters less than the model's order, or
+   to the whole order if shorter is 0 */
+int stats_shorten_context(stats_handle *h,int shorter)
+{
+  if (shorter<0||shorter>7) {
+    fprintf(stderr,"Contexts can be shortened by 0 to 7 characters, not %d\n",
+	    shorter);
+    return -1;
+  }
+  h->contextShortening=shorter;
+  h->maximumContext=0;
+  if (shorter)
+    h->maximumContext=(int)h->maximumOrder>shorter?h->maximumOrder-shorter:1;
+  return 0;
+}
+
+/* Decode the tree with this many threads when it is loaded, up to
+   STATS_LOAD_THREADS_MAX.  The nodes are decoded in a different order,
+   but the same tree results. */
+int stats_set_load_threads(stats_handle *h,int threads)
+{
+  if (threads>STATS_LOAD_THREADS_MAX) {
+    fprintf(stderr,"Using %d threads to load the tree instead of %d.\n",
+	    STATS_LOAD_THREADS_MAX,threads);
+    threads=STATS_LOAD_THREADS_MAX;
+  }
+  h->loadThreads=threads;
+  return 0;
+}
+
+/* Node waiting to be decoded by stats_load_tree_parallel(): where it is,
+   the count that bounds it, how far it is below the root, and the
+   pointer in its parent to fill in */
+struct load_task {
+  unsigned int address;
+  unsigned int count;
+  int depth;
+  struct node **slot;
+};
+
+/* Nodes waiting for one thread.  The thread takes the newest, so that it
+   carries on down the subtree it is in, and other threads with nothing to
+   do steal the oldest, which have the biggest subtrees below them. */
+struct load_queue {
+  pthread_mutex_t lock;
+  struct load_task *tasks;
+  int first;
+  int last;
+  int size;
+};
+
+struct tree_loader {
+  stats_handle *h;
+  int threads;
+  struct load_queue *queues;
+  /* Nodes queued or being decoded.  Threads stop once it reaches zero. */
+  int pending;
+  int failed;
+};
+
+struct load_worker {
+  struct tree_loader *l;
+  int id;
+};
+
+int load_queue_put(struct load_queue *q,struct load_task *t)
+{
+  pthread_mutex_lock(&q->lock);
+  if (q->last==q->size) {
+    /* Reuse the space of tasks already taken, or else grow */
+    if (q->first) {
+      memmove(q->tasks,&q->tasks[q->first],
+	      sizeof(struct load_task)*(q->last-q->first));
+      q->last-=q->first;
+      q->first=0;
+    }
+    if (q->last==q->size) {
+      int size=q->size?q->size*2:256;
+      struct load_task *tasks=realloc(q->tasks,sizeof(struct load_task)*size);
+      if (!tasks) {
+	pthread_mutex_unlock(&q->lock);
+	return -1;
+      }
+      q->tasks=tasks;
+      q->size=size;
+    }
+  }
+  q->tasks[q->last++]=*t;
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+/* Take the newest task if ownP, or else the oldest.  Returns 0 if there
+   are none. */
+int load_queue_take(struct load_queue *q,struct load_task *t,int ownP)
+{
+  int found=0;
+  pthread_mutex_lock(&q->lock);
+  if (q->first<q->last) {
+    *t=ownP?q->tasks[--q->last]:q->tasks[q->first++];
+    found=1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+/* Decode one node, as extractNodeAt() would, and queue its children.  A
+   node that cannot be decoded is left out of the tree, as is any below
+   the maximum order. */
+int stats_load_node(struct tree_loader *l,int id,struct load_task *t)
+{
+  stats_handle *h=l->h;
+  struct node *n=calloc(sizeof(struct node),1);
+  unsigned int totalCount,childCount;
+  unsigned int childAddresses[CHARCOUNT];
+  int i;
+
+  if (!n) return -1;
+  if (decodeNodeAt(h,t->address,t->count,&totalCount,n->counts,
+		   &childCount,childAddresses,0)) {
+    free(n);
+    return 0;
+  }
+  n->count=totalCount;
+  *t->slot=n;
+
+  if (t->depth>=h->maximumOrder) return 0;
+  for(i=CHARCOUNT-1;i>=0;i--) {
+    if (!childAddresses[i]) continue;
+    struct load_task child={childAddresses[i],childCount,t->depth+1,
+			    &n->children[i]};
+    __sync_fetch_and_add(&l->pending,1);
+    if (load_queue_put(&l->queues[id],&child)) {
+      __sync_fetch_and_sub(&l->pending,1);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void *stats_load_worker(void *arg)
+{
+  struct load_worker *w=arg;
+  struct tree_loader *l=w->l;
+  struct load_task t;
+  int i;
+
+  while(__atomic_load_n(&l->pending,__ATOMIC_ACQUIRE)) {
+    int found=load_queue_take(&l->queues[w->id],&t,1);
+    for(i=1;i<l->threads&&!found;i++)
+      found=load_queue_take(&l->queues[(w->id+i)%l->threads],&t,0);
+    if (!found) {
+      /* Other threads are still decoding nodes, and may queue more */
+      sched_yield();
+      continue;
+    }
+    if (!__atomic_load_n(&l->failed,__ATOMIC_RELAXED)
+	&&stats_load_node(l,w->id,&t))
+      __atomic_store_n(&l->failed,1,__ATOMIC_RELAXED);
+    __sync_fetch_and_sub(&l->pending,1);
+  }
+  return NULL;
+}
+
+/* Decode the whole tree into h->tree, as extractNodeAt() does, but with
+   several threads.  Once a node is decoded the addresses of its children
+   are known, and each subtree can be decoded independently of the
+   others.  Each thread queues the children of the nodes it decodes, and
+   threads that run out of work steal from the others.  The file must be
+   mapped, as the block cache cannot be shared. */
+int stats_load_tree_parallel(stats_handle *h,int threads)
+{
+  struct tree_loader loader,*l=&loader;
+  pthread_t *tids;
+  struct load_worker *workers;
+  int i,started;
+
+  bzero(l,sizeof(loader));
+  l->h=h;
+  l->threads=threads;
+  l->queues=calloc(sizeof(struct load_queue),threads);
+  tids=calloc(sizeof(pthread_t),threads);
+  workers=calloc(sizeof(struct load_worker),threads);
+  if (!l->queues||!tids||!workers) {
+    fprintf(stderr,"Could not allocate memory to load tree\n");
+    if (l->queues) free(l->queues);
+    if (tids) free(tids);
+    if (workers) free(workers);
+    return -1;
+  }
+  for(i=0;i<threads;i++) pthread_mutex_init(&l->queues[i].lock,NULL);
+
+  struct load_task root={h->rootNodeAddress,h->totalCount,0,&h->tree};
+  l->pending=1;
+  load_queue_put(&l->queues[0],&root);
+
+  /* This thread is worker 0, and does it all if no others can start */
+  for(i=0;i<threads;i++) {
+    workers[i].l=l;
+    workers[i].id=i;
+  }
+  for(started=1;started<threads;started++)
+    if (pthread_create(&tids[started],NULL,stats_load_worker,
+		       &workers[started])) break;
+  stats_load_worker(&workers[0]);
+  for(i=1;i<started;i++) pthread_join(tids[i],NULL);
+
+  for(i=0;i<threads;i++) {
+    pthread_mutex_destroy(&l->queues[i].lock);
+    if (l->queues[i].tasks) free(l->queues[i].tasks);
+  }
+  free(l->queues);
+  free(tids);
+  free(workers);
+
+  if (l->failed) {
+    fprintf(stderr,"Could not allocate memory to load tree\n");
+    if (h->tree) node_free_recursive(h->tree);
+    h->tree=NULL;
+    return -1;
+  }
+  return 0;
+}
+
+int stats_load_tree(stats_handle *h)
+{  
+  /* Already loaded */
+  if (h->flat) return 0;
+
+  if (h->loadThreads>1&&h->mmap&&!h->dummyOffset)
+    stats_load_tree_parallel(h,h->loadThreads);
+  else
+    extractNodeAt(NULL,0,h->rootNodeAddress,h->totalCount,h,
+		  1 /* extract all */,0);
+  if (!h->tree) return -1;
+
+  /* Keep only the flattened copy, which is a fraction of the size */
+  int r=stats_flatten_tree(h);
+  node_free_recursive(h->tree);
+  h->tree=NULL;
+  if (r) {
+    if (h->flat) free(h->flat);
+    if (h->flatCounts) free(h->flatCounts);
+    if (h->flatQuantised) free(h->flatQuantised);
+    if (h->flatExt) free(h->flatExt);
+    h->flat=NULL; h->flatCounts=NULL; h->flatQuantised=NULL; h->flatExt=NULL;
+  }
+  return r;
+}
+
+static inline unsigned int context_hash(stats_handle *h,unsigned long long key)
+{
+  return (key*0x9e3779b97f4a7c15ULL)>>(64-h->contextIndexBits);
+}
+
+/* Node with the context whose key is given, or 0 if there is none */
+static inline unsigned int context_index_get(stats_handle *h,
+					     unsigned long long key)
+{
+  unsigned int mask=(1<<h->contextIndexBits)-1;
+  unsigned int i=context_hash(h,key);
+  for(;h->contextIndex[i].key;i=(i+1)&mask)
+    if (h->contextIndex[i].key==key) return h->contextIndex[i].node;
+  return 0;
+}
+
+/* Index every node of the flattened tree by its context, so that
+   extractVector() can look up the suffixes of a string directly, rather
+   than walking down the tree one character at a time.  The table has at
+   least twice as many entries as there are nodes. */
+int stats_index_contexts(stats_handle *h)
+{
+  if (h->contextIndex) return 0;
+  if (stats_load_tree(h)) return -1;
+  if (h->maximumOrder>CONTEXT_INDEX_MAX_ORDER) {
+    fprintf(stderr,"Cannot index contexts of more than %d characters\n",
+	    CONTEXT_INDEX_MAX_ORDER);
+    return -1;
+  }
+
+  int n=h->flatNodeCount;
+  int bits=1;
+  while((1<<bits)<2*n) bits++;
+  unsigned long long *keys=malloc(sizeof(unsigned long long)*n);
+  unsigned char *depths=malloc(n);
+  h->contextIndex=calloc(sizeof(struct context_index_entry),1<<bits);
+  if (!keys||!depths||!h->contextIndex) {
+    fprintf(stderr,"Could not allocate index of %d contexts\n",n);
+    if (keys) free(keys);
+    if (depths) free(depths);
+    if (h->contextIndex) free(h->contextIndex);
+    h->contextIndex=NULL;
+    return -1;
+  }
+  h->contextIndexBits=bits;
+
+  /* Parents come before their children, so walk down the tree in order */
+  int i,c;
+  keys[0]=0;
+  depths[0]=0;
+  for(i=0;i<n;i++) {
+    struct flat_node *f=&h->flat[i];
+    int child=f->firstChild;
+    for(c=0;c<CHARCOUNT;c++) {
+      if (!flat_bit(f->childBits,c)) continue;
+      keys[child]=keys[i]|((unsigned long long)(c+1)<<(7*depths[i]));
+      depths[child]=depths[i]+1;
+      unsigned int e=context_hash(h,keys[child]);
+      while(h->contextIndex[e].key) e=(e+1)&((1<<bits)-1);
+      h->contextIndex[e].key=keys[child];
+      h->contextIndex[e].node=child;
+      child++;
+    }
+  }
+  free(keys);
+  free(depths);
+  return 0;
+}
+
+/* Instead of preloading the tree, decode each node from the file the
+   first time that a context reaches it.  About cacheBytes of decoded
+   nodes are kept, and the least recently used are evicted when it is
+   full.  This starts much faster and in bounded memory, and unlike
+   extractNodeAt() does not decode the whole path from the root again for
+   every character. */
+int stats_lazy_tree(stats_handle *h,int cacheBytes)
+{
+  /* The preloaded tree is always faster */
+  if (h->flat) return 0;
+
+  int count=cacheBytes/(int)sizeof(struct lazy_node);
+  if (count<1) count=1;
+  int bits=1;
+  while((1<<bits)<count*2) bits++;
+
+  if (h->lazyNodes) free(h->lazyNodes);
+  if (h->lazyHash) free(h->lazyHash);
+  h->lazyNodes=malloc(sizeof(struct lazy_node)*count);
+  h->lazyHash=malloc(sizeof(int)<<bits);
+  if (!h->lazyNodes||!h->lazyHash) {
+    fprintf(stderr,"Could not allocate cache of %d tree nodes\n",count);
+    if (h->lazyNodes) free(h->lazyNodes);
+    if (h->lazyHash) free(h->lazyHash);
+    h->lazyNodes=NULL; h->lazyHash=NULL;
+    return -1;
+  }
+
+  int i;
+  for(i=0;i<(1<<bits);i++) h->lazyHash[i]=-1;
+  h->lazyHashBits=bits;
+  h->lazyNodeCount=count;
+  h->lazyNodesUsed=0;
+  h->lazyNewest=-1;
+  h->lazyOldest=-1;
+  return 0;
+}
+
+static inline int lazy_hash(stats_handle *h,unsigned int address)
+{
+  return (address*2654435761U)>>(32-h->lazyHashBits);
+}
+
+static inline void lazy_unlink(stats_handle *h,int i)
+{
+  struct lazy_node *e=&h->lazyNodes[i];
+  if (e->newer>=0) h->lazyNodes[e->newer].older=e->older;
+  else h->lazyNewest=e->older;
+  if (e->older>=0) h->lazyNodes[e->older].newer=e->newer;
+  else h->lazyOldest=e->newer;
+}
+
+static inline void lazy_make_newest(stats_handle *h,int i)
+{
+  struct lazy_node *e=&h->lazyNodes[i];
+  e->older=h->lazyNewest;
+  e->newer=-1;
+  if (h->lazyNewest>=0) h->lazyNodes[h->lazyNewest].newer=i;
+  else h->lazyOldest=i;
+  h->lazyNewest=i;
+}
+
+/* Return the node at nodeAddress from the lazy tree cache, decoding it if
+   it is not there.  count is the count of the parent, as for
+   extractNodeAt(). */
+struct lazy_node *lazyNodeAt(stats_handle *h,unsigned int nodeAddress,
+			     int count)
+{
+  int bucket=lazy_hash(h,nodeAddress);
+  int i;
+
+  for(i=h->lazyHash[bucket];i>=0;i=h->lazyNodes[i].hashNext)
+    if (h->lazyNodes[i].address==nodeAddress) {
+      if (h->lazyNewest!=i) {
+	lazy_unlink(h,i);
+	lazy_make_newest(h,i);
+      }
+      return &h->lazyNodes[i];
+    }
+
+  /* Decode before evicting anything, so that a failure leaves the cache
+     as it was */
+  struct lazy_node n;
+  unsigned int totalCount;
+  unsigned int counts[CHARCOUNT];
+  if (decodeNodeAt(h,nodeAddress,count,&totalCount,counts,
+		   &n.childCount,n.childAddresses,0)) return NULL;
+  int scale=0xffffff/(totalCount+CHARCOUNT);
+  if (scale==0) {
+    fprintf(stderr,"n->count+CHARCOUNT = 0x%x > 0xffffff - this really shouldn't happen.  Your stats.dat file is probably corrupt.\n",totalCount);
+    return NULL;
+  }
+  int cumulative=0;
+  for(i=0;i<CHARCOUNT;i++) {
+    cumulative+=(counts[i]+1)*scale;
+    n.v.v[i]=cumulative;
   }
-  fprintf(stderr,"Read case and message length statistics.\n");
 
-  /* Try to mmap() */
-  h->mmap=mmap(NULL, h->fileLength, PROT_READ, MAP_SHARED, fileno(h->file), 0);
-  if (h->mmap!=MAP_FAILED) return h;
-  
-  /* mmap failed, so create buffer and bitmap for keeping track of which parts have 
-     been loaded. */
-  h->mmap=NULL;
+  if (h->lazyNodesUsed<h->lazyNodeCount) i=h->lazyNodesUsed++;
+  else {
+    i=h->lazyOldest;
+    lazy_unlink(h,i);
+    int *p=&h->lazyHash[lazy_hash(h,h->lazyNodes[i].address)];
+    while(*p!=i) p=&h->lazyNodes[*p].hashNext;
+    *p=h->lazyNodes[i].hashNext;
+  }
 
-  h->buffer=malloc(h->fileLength);
-  h->bufferBitmap=calloc((h->fileLength+1)>>10,1);
-  return h;
+  struct lazy_node *e=&h->lazyNodes[i];
+  *e=n;
+  e->address=nodeAddress;
+  e->hashNext=h->lazyHash[bucket];
+  h->lazyHash[bucket]=i;
+  lazy_make_newest(h,i);
+  return e;
 }
 
-int stats_load_tree(stats_handle *h)
-{  
-  extractNodeAt(NULL,0,h->rootNodeAddress,h->totalCount,h,
-		1 /* extract all */,0);
-  return 0;
+/* Vector for the deepest node of the lazy tree that matches the end of
+   string.  The vector stays valid until the next lookup. */
+struct probability_vector *lazyVector(unsigned short *string,int len,
+				      stats_handle *h)
+{
+  struct lazy_node *n=lazyNodeAt(h,h->rootNodeAddress,h->totalCount);
+  int i;
+
+  if (!n) return NULL;
+  for(i=len-1;i>=0;i--) {
+    int symbol=charIdx(string[i]);
+    if (symbol<0||!n->childAddresses[symbol]) break;
+    /* Looking up the child may evict n, which is fine as we are done
+       with it */
+    struct lazy_node *child=lazyNodeAt(h,n->childAddresses[symbol],
+				       n->childCount);
+    if (!child) break;
+    n=child;
+  }
+  return &n->v;
 }
 
 unsigned char *getCompressedBytes(stats_handle *h,int start,int count)
@@ -172,50 +1438,47 @@ unsigned char *getCompressedBytes(stats_handle *h,int start,int count)
   /* If file is memory mapped, just return the address to the piece in question */
   if (h->mmap) return &h->mmap[start-h->dummyOffset];
   
-  /* not memory mapped, so pull in the appropriate part of the file as required */
-  int i;
-  for(i=((start)>>10);i<=((start+count)>>10);i++)
-    {
-      if (!h->bufferBitmap[i]) {
-	fread(&h->buffer[i<<10],1024,1,h->file);
-	h->bufferBitmap[i]=1;
-      }
-    }
-  return &h->buffer[start];
+  /* Not memory mapped, so read the block it starts in.  The bytes stay
+     valid until the next call. */
+  if (count>STATS_BLOCK_OVERLAP) {
+    fprintf(stderr,"Cannot read %d bytes at once from unmapped stats file\n",
+	    count);
+    return NULL;
+  }
+  if (!h->blocks&&stats_block_cache_init(h)) return NULL;
+  struct stats_block *b=stats_get_block(h,start/STATS_BLOCK_SIZE);
+  if (!b) return NULL;
+  return &b->data[start%STATS_BLOCK_SIZE];
 }
 
-struct node *extractNodeAt(unsigned short *s,int len,unsigned int nodeAddress,
-			   int count,stats_handle *h,int extractAllP,int debug)
+/* Decode the node stored at nodeAddress: its own count, the count for
+   each symbol, and the address of the child for each symbol, or 0 where
+   there is none.  count is the count of the node's parent, which bounds
+   the count of this one.  *childCount is the sum of the symbol counts,
+   which is what bounds the counts of the children in turn. */
+int decodeNodeAt(stats_handle *h,unsigned int nodeAddress,int count,
+		 unsigned int *totalCountOut,unsigned int counts[CHARCOUNT],
+		 unsigned int *childCount,
+		 unsigned int childAddresses[CHARCOUNT],int debug)
 {
-  if (len<(0-(int)h->maximumOrder)) {
-    // We are diving deeper than the maximum order that we expected to see.
-    // This indicates an error.
-    // fprintf(stderr,"len=%d, maximumOrder=0x%x\n",len,h->maximumOrder);
-    return NULL;
-  }
   if (nodeAddress<700) {
     // The first 700 or so bytes are all fixed header.
     // If we have been asked to extract a node from here, it indicates an error.
-    return NULL;
-  }
-  
-  if (0) {
-    if (s[len]) fprintf(stderr,"Extracting node '%c' @ 0x%x\n",s[len],nodeAddress);
-    else fprintf(stderr,"Extracting root node @ 0x%x?\n",nodeAddress);
+    return -1;
   }
  
-  range_coder *c=range_new_coder(0);
-  c->bit_stream=getCompressedBytes(h,nodeAddress,1024);
-  c->bit_stream_length=1024*8;
-  c->bits_used=0;
-  c->low=0; c->high=0xffffffff;
+  unsigned char *bits=getCompressedBytes(h,nodeAddress,1024);
+  if (!bits) return -1;
+  range_coder coder,*c=&coder;
+  range_coder_init(c,bits,1024);
   range_decode_prefetch(c);
 
-  unsigned int totalCount=range_decode_equiprobable(c,count+1);
+  int totalCount=range_decode_equiprobable(c,count+1);
   int children=range_decode_equiprobable(c,CHARCOUNT+1);
   int storedChildren=range_decode_equiprobable(c,CHARCOUNT+1);
+  if (totalCount<0||children<0||storedChildren<0) return -1;
   unsigned int progressiveCount=0;
-  unsigned int thisCount;
+  int thisCount;
 
   unsigned int highAddr=nodeAddress;
   unsigned int lowAddr=0;
@@ -230,30 +1493,77 @@ struct node *extractNodeAt(unsigned short *s,int len,unsigned int nodeAddress,
 	    "children=%d, storedChildren=%d, count=%d, superCount=%d @ 0x%x\n",
 	    children,storedChildren,totalCount,count,nodeAddress);
 
-  struct node *n=calloc(sizeof(struct node),1);
-
-  struct node *ret=n;
-  /* If extracting all of tree, then retain pointer to root of tree */
-  if (extractAllP&&(!h->tree)) h->tree=n;
-
-  n->count=totalCount;
+  *totalCountOut=totalCount;
 
   for(i=0;i<CHARCOUNT;i++) {
     hasCount=(CHARCOUNT-i-children)*0xffffff/(CHARCOUNT-i);
 
     int countPresent=range_decode_symbol(c,&hasCount,2);
+    if (countPresent<0) return -1;
+    counts[i]=0;
     if (countPresent) {
       thisCount=range_decode_equiprobable(c,(totalCount-progressiveCount)+1);
+      if (thisCount<0) return -1;
       if (debug)
 	fprintf(stderr,"  decoded %d of %d for '%c'\n",thisCount,
 		(totalCount-progressiveCount)+1,chars[i]);
       progressiveCount+=thisCount;
       children--;
-      n->counts[i]=thisCount;
-    } else {
-      // fprintf(stderr,"  no count for '%c' %d\n",chars[i],i);
+      counts[i]=thisCount;
+    }
+  }
+  *childCount=progressiveCount;
+
+  for(i=0;i<CHARCOUNT;i++) {
+    isStored=(CHARCOUNT-i-storedChildren)*0xffffff/(CHARCOUNT-i);    
+    int addrP=range_decode_symbol(c,&isStored,2);
+    if (addrP<0) return -1;
+    childAddresses[i]=0;
+    if (addrP) {
+      int offset=range_decode_equiprobable(c,highAddr-lowAddr+1);
+      if (offset<0) return -1;
+      childAddress=lowAddr+offset;
+      if (debug) fprintf(stderr,"    decoded addr=%d of %d (lowAddr=%d)\n",
+			 childAddress-lowAddr,highAddr-lowAddr+1,lowAddr);
+      lowAddr=childAddress;     
+      childAddresses[i]=childAddress;
+      storedChildren--;
     }
   }
+  return 0;
+}
+
+struct node *extractNodeAt(unsigned short *s,int len,unsigned int nodeAddress,
+			   int count,stats_handle *h,int extractAllP,int debug)
+{
+  if (len<(0-(int)h->maximumOrder)) {
+    // We are diving deeper than the maximum order that we expected to see.
+    // This indicates an error.
+    // fprintf(stderr,"len=%d, maximumOrder=0x%x\n",len,h->maximumOrder);
+    return NULL;
+  }
+  
+  if (0) {
+    if (s[len]) fprintf(stderr,"Extracting node '%c' @ 0x%x\n",s[len],nodeAddress);
+    else fprintf(stderr,"Extracting root node @ 0x%x?\n",nodeAddress);
+  }
+
+  struct node *n=calloc(sizeof(struct node),1);
+  unsigned int totalCount,childCount;
+  unsigned int childAddresses[CHARCOUNT];
+  int i;
+
+  if (decodeNodeAt(h,nodeAddress,count,&totalCount,n->counts,
+		   &childCount,childAddresses,debug)) {
+    free(n);
+    return NULL;
+  }
+
+  struct node *ret=n;
+  /* If extracting all of tree, then retain pointer to root of tree */
+  if (extractAllP&&(!h->tree)) h->tree=n;
+
+  n->count=totalCount;
 
   if (debug) {
     int i;
@@ -264,35 +1574,28 @@ struct node *extractNodeAt(unsigned short *s,int len,unsigned int nodeAddress,
   }
 
   for(i=0;i<CHARCOUNT;i++) {
-    isStored=(CHARCOUNT-i-storedChildren)*0xffffff/(CHARCOUNT-i);    
-    int addrP=range_decode_symbol(c,&isStored,2);
-    if (addrP) {
-      childAddress=lowAddr+range_decode_equiprobable(c,highAddr-lowAddr+1);      
-      if (debug) fprintf(stderr,"    decoded addr=%d of %d (lowAddr=%d)\n",
-			 childAddress-lowAddr,highAddr-lowAddr+1,lowAddr);
-      lowAddr=childAddress;     
-      if (extractAllP||(len>0&&chars[i]==s[len-1])) {
-	/* Only extract children if not in dummy mode, as in dummy mode
-	   the rest of the file is unlikely to be present, and so extracting
-	   children will most likely result in segfault. */
-	if (!h->dummyOffset) {
-	  n->children[i]=extractNodeAt(s,len-1,childAddress,
-				       progressiveCount,h,
-				       extractAllP,debug);
-	  if (n->children[i])
-	    {
-	      if (0) 
-		fprintf(stderr,"Found deeper stats for string offset %d\n",len-1);
-	      if (!extractAllP) {
-		ret=n->children[i];
-		node_free(n);
-	      }
-	      if (0) dumpNode(ret);
+    if (!childAddresses[i]) continue;
+    if (extractAllP||(len>0&&chars[i]==s[len-1])) {
+      /* Only extract children if not in dummy mode, as in dummy mode
+	 the rest of the file is unlikely to be present, and so extracting
+	 children will most likely result in segfault. */
+      if (!h->dummyOffset) {
+	n->children[i]=extractNodeAt(s,len-1,childAddresses[i],
+				     childCount,h,
+				     extractAllP,debug);
+	if (n->children[i])
+	  {
+	    if (0) 
+	      fprintf(stderr,"Found deeper stats for string offset %d\n",len-1);
+	    if (!extractAllP) {
+	      ret=n->children[i];
+	      node_free(n);
+	      break;
 	    }
-	}
+	    if (0) dumpNode(ret);
+	  }
       }
-      storedChildren--;
-    } else childAddress=0;
+    }
   }
 
   if (debug) {
@@ -303,11 +1606,6 @@ struct node *extractNodeAt(unsigned short *s,int len,unsigned int nodeAddress,
     dumpNode(ret);
   }
 
-  /* c->bit_stream is provided locally, so we must free the range coder manually,
-     instead of using range_coder_free() */
-  c->bit_stream=NULL;
-  free(c);
-
   return ret;
 }
 
@@ -345,7 +1643,17 @@ struct node *extractNode(unsigned short *string,int len,stats_handle *h)
 
   struct node *n;
 
-  if (h->tree) {
+  if (h->flat) {
+    /* Unpack the counts into h->node.  Its children are not filled in. */
+    struct flat_node *f=extractFlatNode(string,len,h);
+    int next=f->firstCount;
+    n=&h->node;
+    bzero(n,sizeof(struct node));
+    n->count=f->count;
+    for(i=0;i<CHARCOUNT;i++)
+      if (flat_bit(f->countBits,i)) n->counts[i]=flat_count(h,next++);
+    return n;
+  } else if (h->tree) {
     n=h->tree;
     for(i=len-1;i>=0;i--) {
       if (!n->children[charIdx(string[i])]) return n;
@@ -381,6 +1689,408 @@ struct node *extractNode(unsigned short *string,int len,stats_handle *h)
   return n;
 }
 
+/* Deepest node of the flattened tree that matches the end of string */
+struct flat_node *extractFlatNode(unsigned short *string,int len,
+				  stats_handle *h)
+{
+  struct flat_node *f=&h->flat[0];
+  int i;
+
+  for(i=len-1;i>=0;i--) {
+    int symbol=charIdx(string[i]);
+    if (symbol<0||!flat_bit(f->childBits,symbol)) break;
+    f=&h->flat[f->firstChild+flat_rank(f->childBits,symbol)];
+  }
+  return f;
+}
+
+/* As extractFlatNode(), but using h->contextIndex, and returning the
+   number of the node.  Every shorter suffix of a context in the tree is
+   also in the tree, so the longest one that string ends with is found by
+   a binary search on its length, with a lookup for each step, instead of
+   a dependent load for every character. */
+unsigned int indexedFlatNode(unsigned short *string,int len,stats_handle *h)
+{
+  unsigned long long keys[CONTEXT_INDEX_MAX_ORDER+1];
+  int longest=len<(int)h->maximumOrder?len:(int)h->maximumOrder;
+  int k;
+
+  keys[0]=0;
+  for(k=1;k<=longest;k++) {
+    int symbol=charIdx(string[len-k]);
+    if (symbol<0) break;
+    keys[k]=keys[k-1]|((unsigned long long)(symbol+1)<<(7*(k-1)));
+  }
+
+  /* The context of length low is in the tree, and none longer than high */
+  int low=0,high=k-1;
+  unsigned int node=0;
+  while(low<high) {
+    int middle=(low+high+1)>>1;
+    unsigned int found=context_index_get(h,keys[middle]);
+    if (found) {
+      low=middle;
+      node=found;
+    } else high=middle-1;
+  }
+  return node;
+}
+
+/* Cumulative frequencies from a node's counts, with one added to every
+   count so that no symbol is impossible */
+int flatVector(stats_handle *h,struct flat_node *f,struct probability_vector *v)
+{
+  unsigned int total=f->count;
+  int i;
+
+  if (h->quantisedBits) {
+    /* Counts rounded up may add up to more than the node's count */
+    unsigned int sum=0;
+    int present=0;
+    for(i=0;i<FLAT_BITMAP_WORDS;i++) present+=__builtin_popcount(f->countBits[i]);
+    for(i=0;i<present;i++) sum+=flat_count(h,f->firstCount+i);
+    if (sum>total) total=sum;
+  }
+
+  int scale=0xffffff/(total+CHARCOUNT);
+  if (scale==0) {
+    fprintf(stderr,"n->count+CHARCOUNT = 0x%x > 0xffffff - this really shouldn't happen.  Your stats.dat file is probably corrupt.\n",total);
+    return -1;
+  }
+  int next=f->firstCount;
+  int cumulative=0;
+  for(i=0;i<CHARCOUNT;i++) {
+    cumulative+=scale;
+    if (flat_bit(f->countBits,i)) cumulative+=flat_count(h,next++)*scale;
+    v->v[i]=cumulative;
+  }
+  return 0;
+}
+
+/* Pad the snapshot out to the next cache line, where the next section
+   starts, and write the section if it is already to hand */
+int stats_snapshot_section(FILE *f,unsigned int *offset,void *data,int bytes)
+{
+  long position=ftell(f);
+  while(position&63) { fputc(0,f); position++; }
+  *offset=position;
+  if (bytes>0&&fwrite(data,bytes,1,f)!=1) return -1;
+  return 0;
+}
+
+/* Load the statistics for every code page, and find for each the first
+   page with the same statistics.  Most pages have no statistics of their
+   own, and so are all the same, and need only be stored once. */
+int stats_share_unicode_pages(stats_handle *h,int firstSame[512])
+{
+  int i,j;
+
+  for(i=1;i<512;i++) {
+    if (!getUnicodeStatistics(h,i)) return -1;
+    for(j=1;j<i;j++)
+      if (firstSame[j]==j
+	  &&!memcmp(h->unicode_pages[i],h->unicode_pages[j],
+		    sizeof(struct unicode_page_statistics))) break;
+    firstSame[i]=j;
+  }
+  return 0;
+}
+
+/* Write the whole model, decoded, as a snapshot that stats_new_handle()
+   can map and use in place, so that processes using it start at once
+   and share one copy of it. */
+int stats_write_snapshot(stats_handle *h,char *file)
+{
+  struct stats_snapshot_header s;
+  struct probability_vector v;
+  int firstSame[512];
+  int uniqueCount=0;
+  int i;
+
+  if (stats_load_tree(h)) {
+    fprintf(stderr,"Could not load model to write snapshot\n");
+    return -1;
+  }
+  if (h->quantisedBits) {
+    fprintf(stderr,"Cannot write a snapshot of quantised counts\n");
+    return -1;
+  }
+  FILE *f=fopen(file,"w");
+  if (!f) {
+    fprintf(stderr,"Could not create model snapshot '%s'\n",file);
+    return -1;
+  }
+
+  bzero(&s,sizeof(s));
+  memcpy(s.magic,STATS_SNAPSHOT_MAGIC,4);
+  s.byteOrder=STATS_SNAPSHOT_BYTE_ORDER;
+  s.charCount=CHARCOUNT;
+  s.headerSize=sizeof(s);
+  s.flatNodeSize=sizeof(struct flat_node);
+  s.totalCount=h->totalCount;
+  s.maximumOrder=h->maximumOrder;
+  bcopy(h->casestartofmessage,s.casestartofmessage,
+	sizeof(s.casestartofmessage));
+  bcopy(h->casestartofword2,s.casestartofword2,sizeof(s.casestartofword2));
+  bcopy(h->casestartofword3,s.casestartofword3,sizeof(s.casestartofword3));
+  bcopy(h->caseposn1,s.caseposn1,sizeof(s.caseposn1));
+  bcopy(h->caseposn2,s.caseposn2,sizeof(s.caseposn2));
+  bcopy(h->messagelengths,s.messagelengths,sizeof(s.messagelengths));
+  bcopy(&h->messagelengths_index,&s.messagelengths_index,
+	sizeof(s.messagelengths_index));
+  s.flatNodeCount=h->flatNodeCount;
+  s.flatCountCount=h->flatCountCount;
+  s.flatExtCount=h->flatExt?h->flatExtCount:0;
+
+  /* The header is written again once the offsets are known */
+  int r=fwrite(&s,sizeof(s),1,f)!=1;
+  r|=stats_snapshot_section(f,&s.flatOffset,h->flat,
+			    sizeof(struct flat_node)*h->flatNodeCount);
+  r|=stats_snapshot_section(f,&s.flatCountsOffset,h->flatCounts,
+			    sizeof(unsigned int)*h->flatCountCount);
+  r|=stats_snapshot_section(f,&s.flatExtOffset,h->flatExt,
+			    sizeof(unsigned int)*s.flatExtCount);
+  r|=stats_snapshot_section(f,&s.vectorsOffset,NULL,0);
+  for(i=0;i<h->flatNodeCount&&!r;i++) {
+    r|=flatVector(h,&h->flat[i],&v);
+    r|=fwrite(&v,sizeof(v),1,f)!=1;
+  }
+
+  if (!r) r=stats_share_unicode_pages(h,firstSame);
+  for(i=1;i<512&&!r;i++) {
+    if (firstSame[i]!=i) {
+      s.unicodePageOffsets[i]=s.unicodePageOffsets[firstSame[i]];
+      continue;
+    }
+    uniqueCount++;
+    r|=stats_snapshot_section(f,&s.unicodePageOffsets[i],h->unicode_pages[i],
+			      sizeof(struct unicode_page_statistics));
+  }
+
+  s.fileLength=ftell(f);
+  if (!r) {
+    fseek(f,0,SEEK_SET);
+    r|=fwrite(&s,sizeof(s),1,f)!=1;
+  }
+  r|=fclose(f);
+  if (r) {
+    fprintf(stderr,"Could not write model snapshot '%s'\n",file);
+    return -1;
+  }
+  fprintf(stderr,"Wrote model snapshot of %d nodes and %d unicode pages (%d bytes).\n",
+	  h->flatNodeCount,uniqueCount,s.fileLength);
+  return 0;
+}
+
+/* Write a list of values as a C initialiser */
+int stats_write_c_values(FILE *f,const unsigned int *v,int count)
+{
+  int i;
+  for(i=0;i<count;i++)
+    fprintf(f,"%s%u",i?((i%10)?",":",\n  "):"",v[i]);
+  return 0;
+}
+
+/* Write a multi-dimensional array as a C initialiser, with braces for
+   each dimension */
+int stats_write_c_array(FILE *f,const unsigned int *v,int *dims,int depth)
+{
+  int i,step=1;
+
+  fprintf(f,"{");
+  if (depth==1) stats_write_c_values(f,v,dims[0]);
+  else {
+    for(i=1;i<depth;i++) step*=dims[i];
+    for(i=0;i<dims[0];i++) {
+      if (i) fprintf(f,",");
+      stats_write_c_array(f,&v[i*step],&dims[1],depth-1);
+    }
+  }
+  fprintf(f,"}");
+  return 0;
+}
+
+/* Write the whole model, decoded, as C source for constant tables and a
+   function, <name>_new_handle(), that returns a handle using them.  A
+   program linked with it can then use the model without any file or
+   start up cost, and the tables are shared read-only pages. */
+int stats_write_tables_c(stats_handle *h,char *file,char *name)
+{
+  struct probability_vector v;
+  int firstSame[512];
+  int i,j;
+
+  if (stats_load_tree(h)||stats_share_unicode_pages(h,firstSame)) {
+    fprintf(stderr,"Could not load model to compile\n");
+    return -1;
+  }
+  if (h->quantisedBits) {
+    fprintf(stderr,"Cannot compile a model with quantised counts\n");
+    return -1;
+  }
+  FILE *f=fopen(file,"w");
+  if (!f) {
+    fprintf(stderr,"Could not create '%s'\n",file);
+    return -1;
+  }
+
+  fprintf(f,"/* Model compiled by `smac compile': do not edit.\n"
+	  "   Call %s_new_handle() in place of stats_new_handle(). */\n\n"
+	  "#include <stdio.h>\n"
+	  "#include \"arithmetic.h\"\n"
+	  "#include \"charset.h\"\n"
+	  "#include \"packed_stats.h\"\n\n"
+	  "#if CHARCOUNT!=%d||FLAT_BITMAP_WORDS!=%d\n"
+	  "#error Model was compiled for a different character set\n"
+	  "#endif\n\n",name,CHARCOUNT,FLAT_BITMAP_WORDS);
+
+  fprintf(f,"static const struct stats_snapshot_header %s_header={\n"
+	  "  .magic=STATS_SNAPSHOT_MAGIC,\n"
+	  "  .byteOrder=STATS_SNAPSHOT_BYTE_ORDER,\n"
+	  "  .charCount=CHARCOUNT,\n"
+	  "  .headerSize=sizeof(struct stats_snapshot_header),\n"
+	  "  .flatNodeSize=sizeof(struct flat_node),\n"
+	  "  .totalCount=%u,\n  .maximumOrder=%u,\n"
+	  "  .flatNodeCount=%d,\n  .flatCountCount=%d,\n"
+	  "  .flatExtCount=%d,\n",
+	  name,h->totalCount,h->maximumOrder,
+	  h->flatNodeCount,h->flatCountCount,h->flatExtCount);
+  int dims[][4]={{1,1},{2,1},{2,2,1},{80,1},{2,80,1},{1024}};
+#define TABLE(X,D,DEPTH)						\
+  fprintf(f,"  ." #X "=");						\
+  stats_write_c_array(f,(unsigned int *)h->X,dims[D],DEPTH);		\
+  fprintf(f,",\n");
+  TABLE(casestartofmessage,0,2);
+  TABLE(casestartofword2,1,2);
+  TABLE(casestartofword3,2,3);
+  TABLE(caseposn1,3,2);
+  TABLE(caseposn2,4,3);
+  TABLE(messagelengths,5,1);
+#undef TABLE
+  fprintf(f,"  .messagelengths_index={{\n  ");
+  for(i=0;i<=FREQUENCY_INDEX_BUCKETS;i++)
+    fprintf(f,"%s%u",i?((i%10)?",":",\n  "):"",
+	    h->messagelengths_index.first[i]);
+  fprintf(f,"}}\n};\n\n");
+
+  fprintf(f,"static const struct flat_node %s_flat[%d]={\n",
+	  name,h->flatNodeCount);
+  for(i=0;i<h->flatNodeCount;i++) {
+    struct flat_node *n=&h->flat[i];
+    fprintf(f,"{%u,%u,%u,{",n->count,n->firstChild,n->firstCount);
+    stats_write_c_values(f,n->childBits,FLAT_BITMAP_WORDS);
+    fprintf(f,"},{");
+    stats_write_c_values(f,n->countBits,FLAT_BITMAP_WORDS);
+    fprintf(f,"},%u,%u,{",n->parent,n->firstExt);
+    stats_write_c_values(f,n->extBits,FLAT_BITMAP_WORDS);
+    fprintf(f,"}},\n");
+  }
+  fprintf(f,"};\n\nstatic const unsigned int %s_counts[%d]={\n  ",
+	  name,h->flatCountCount?h->flatCountCount:1);
+  stats_write_c_values(f,h->flatCounts,h->flatCountCount);
+  fprintf(f,"};\n\nstatic const unsigned int %s_ext[%d]={\n  ",
+	  name,h->flatExtCount?h->flatExtCount:1);
+  stats_write_c_values(f,h->flatExt,h->flatExtCount);
+  fprintf(f,"};\n\n");
+
+  fprintf(f,"static const struct probability_vector %s_vectors[%d]={\n",
+	  name,h->flatNodeCount);
+  for(i=0;i<h->flatNodeCount;i++) {
+    if (flatVector(h,&h->flat[i],&v)) { fclose(f); return -1; }
+    fprintf(f,"{{");
+    for(j=0;j<CHARCOUNT;j++) fprintf(f,"%s%u",j?",":"",v.v[j]);
+    fprintf(f,"}},\n");
+  }
+  fprintf(f,"};\n\n");
+
+  fprintf(f,"static const struct unicode_page_statistics %s_pages[]={\n",
+	  name);
+  for(i=1;i<512;i++) {
+    if (firstSame[i]!=i) continue;
+    fprintf(f,"{{ /* code page 0x%04x */\n  ",i*0x80);
+    stats_write_c_values(f,(unsigned int *)h->unicode_pages[i]->counts,
+			 128+512+1);
+    fprintf(f,"},{{\n  ");
+    for(j=0;j<=FREQUENCY_INDEX_BUCKETS;j++)
+      fprintf(f,"%s%u",j?((j%10)?",":",\n  "):"",
+	      h->unicode_pages[i]->index.first[j]);
+    fprintf(f,"}}},\n");
+  }
+  fprintf(f,"};\n\n");
+
+  fprintf(f,"const struct stats_tables %s={\n"
+	  "  &%s_header,%s_flat,%s_counts,%s_ext,%s_vectors,\n  {NULL",
+	  name,name,name,name,name,name);
+  /* Which of the unique pages each code page uses */
+  int unique[512];
+  int uniqueCount=0;
+  for(i=1;i<512;i++) {
+    if (firstSame[i]==i) unique[i]=uniqueCount++;
+    fprintf(f,",%s&%s_pages[%d]",(i%4)?"":"\n   ",name,unique[firstSame[i]]);
+  }
+  fprintf(f,"}\n};\n\n"
+	  "stats_handle *%s_new_handle()\n{\n"
+	  "  return stats_compiled_handle(&%s);\n}\n",name,name);
+
+  if (fclose(f)) {
+    fprintf(stderr,"Could not write '%s'\n",file);
+    return -1;
+  }
+  fprintf(stderr,"Wrote model of %d nodes and %d unicode pages as C source.\n",
+	  h->flatNodeCount,uniqueCount);
+  return 0;
+}
+
+/* Vector for a node of the flattened tree */
+struct probability_vector *contextVector(stats_handle *h,unsigned int node)
+{
+  if (h->vectors) return &h->vectors[node];
+  if (h->vectorCacheLimit&&!h->vectorCache) stats_vector_cache_init(h);
+  if (h->vectorCache) {
+    vector_cache *e=&h->vectorCache[node%h->vectorCacheSize];
+    if (e->node!=node+1) {
+      e->node=0;
+      if (flatVector(h,&h->flat[node],&e->v)) return NULL;
+      e->node=node+1;
+    }
+    return &e->v;
+  }
+  if (flatVector(h,&h->flat[node],&h->vector)) return NULL;
+  return &h->vector;
+}
+
+/* Node for the context that follows from node when character c is added,
+   i.e., the one that extractFlatNode() would find for the text with c
+   appended.  Requires h->flatExt.  Each step back to a shorter context
+   is paid for by an earlier step that lengthened it, so this takes
+   constant time per character on average, whatever the model order. */
+unsigned int contextNext(stats_handle *h,unsigned int node,unsigned short c)
+{
+  int symbol=charIdx(c);
+  if (symbol<0) return 0;
+
+  while(1) {
+    struct flat_node *f=&h->flat[node];
+    if (flat_bit(f->extBits,symbol))
+      return h->flatExt[f->firstExt+flat_rank(f->extBits,symbol)];
+    if (!node) return 0;
+    node=f->parent;
+  }
+}
+
+/* Node for the newest length characters of node's context, or node itself
+   if it is no longer than that.  If node is the longest context no longer
+   than length, then following it with contextNext() and truncating the
+   result gives the longest context no longer than length again. */
+unsigned int contextTruncate(stats_handle *h,unsigned int node,
+			     unsigned int length)
+{
+  unsigned int depth=0,n;
+  for(n=node;n;n=h->flat[n].parent) depth++;
+  for(;depth>length;depth--) node=h->flat[node].parent;
+  return node;
+}
+
 struct probability_vector *extractVector(unsigned short *string,int len,
 					 stats_handle *h)
 {
@@ -397,22 +2107,39 @@ struct probability_vector *extractVector(unsigned short *string,int len,
   
   if (string[len]) {
     fprintf(stderr,"search strings for extractVector() must be null-terminated.\n");
-    exit(-1);
+    return NULL;
   }
 
   if (!(v)) {
     fprintf(stderr,"%s() could not work out where to put extracted vector.\n",
 	    __FUNCTION__);
-    exit(-1);
+    return NULL;
   }  
 
+  /* Use only the newest characters if contexts are limited */
+  if (h->maximumContext&&len>(int)h->maximumContext) {
+    string+=len-h->maximumContext;
+    len=h->maximumContext;
+  }
+
+  if (h->flat)
+    return contextVector(h,h->contextIndex?indexedFlatNode(string,len,h)
+			 :extractFlatNode(string,len,h)-h->flat);
+
+  if (h->lazyNodes) {
+    v=lazyVector(string,len,h);
+    if (!v)
+      fprintf(stderr,"Could not obtain any statistics (including zero-order frequencies). Broken stats data file?\n");
+    return v;
+  }
+
   /* Wasn't in cache, or there is no cache, so exract it */
   struct node *n=extractNode(string,len,h);
   if (0) fprintf(stderr,"  n=%p\n",n);
   if (!n) {
     fprintf(stderr,"Could not obtain any statistics (including zero-order frequencies). Broken stats data file?\n");
     fprintf(stderr,"  len=%d\n",len);
-    exit(-1);
+    return NULL;
   } 
 
   int i;
@@ -425,7 +2152,7 @@ struct probability_vector *extractVector(unsigned short *string,int len,
   int scale=0xffffff/(n->count+CHARCOUNT);
   if (scale==0) {
     fprintf(stderr,"n->count+CHARCOUNT = 0x%llx > 0xffffff - this really shouldn't happen.  Your stats.dat file is probably corrupt.\n",n->count);
-    exit(-1);
+    return NULL;
   }
   int cumulative=0;
   int sum=0;
@@ -499,63 +2226,116 @@ int vectorReport(char *name,struct probability_vector *v,int s)
   return 0;
 }
 
+/* Prepare a coder for the statistics at address.  They are decoded
+   straight from the mapping if there is one, or else read into buffer
+   with pread(), which leaves the shared file position alone.  Anything
+   past the end of the file reads as zeroes. */
+int stats_unicode_coder(stats_handle *h,unsigned int address,range_coder *c,
+			unsigned char buffer[8192])
+{
+  int bytes=h->fileLength-(int)address;
+  if (bytes<0) bytes=0;
+  if (bytes>8192) bytes=8192;
+  if (h->mmap) range_coder_init(c,&h->mmap[address],bytes);
+  else {
+    int got=0;
+    while(got<bytes) {
+      ssize_t r=pread(fileno(h->file),&buffer[got],bytes-got,
+		      (off_t)address+got);
+      if (r<0&&errno==EINTR) continue;
+      if (r<0) {
+	fprintf(stderr,"Could not read unicode statistics at 0x%x: %s\n",
+		address,strerror(errno));
+	return -1;
+      }
+      if (!r) break;
+      got+=r;
+    }
+    range_coder_init(c,buffer,got);
+  }
+  range_decode_prefetch(c);
+  return 0;
+}
+
+/* Scale cumulative counts to fill the 0-0xffffff range, and index them
+   for decoding */
+int stats_unicode_rescale(struct unicode_page_statistics *p,int totalCount)
+{
+  double rescaleFactor=0xffff00*1.0/(totalCount+1);
+  int i;
+  for(i=0;i<128+512+1;i++) p->counts[i]*=rescaleFactor;
+  range_build_frequency_index(&p->index,(unsigned int *)p->counts,128+512);
+  return 0;
+}
+
 int *getUnicodeStatistics(stats_handle *h,int codePage)
 {
   if (codePage<1||codePage>511) {
     fprintf(stderr,"Illegal code page: 0x%x\n",codePage);
     return NULL;
   }
+  if (h->unicode_pages[codePage]) return h->unicode_pages[codePage]->counts;
+
+  range_coder coder,*c=&coder;
+  unsigned char buffer[8192];
+  int i;
+
   if (!h->unicode_page_addresses) {
     // Load list of addresses to unicode page statistics
-    h->unicode_page_addresses=calloc(sizeof(int),512);
+    /* one extra entry, so that the end of page 511 can be looked up */
+    h->unicode_page_addresses=calloc(sizeof(int),512+1);
+    if (!h->unicode_page_addresses) return NULL;
     int addressRange=h->unicodeAddress-h->rootNodeAddress+512+1;
-    range_coder *c=range_new_coder(8192);
-    fseek(h->file,h->unicodeAddress,SEEK_SET);
-    fread(c->bit_stream,8192,1,h->file);
-    c->bit_stream_length=8192*8;
-    range_decode_prefetch(c);
+    if (stats_unicode_coder(h,h->unicodeAddress,c,buffer)) {
+      free(h->unicode_page_addresses);
+      h->unicode_page_addresses=NULL;
+      return NULL;
+    }
     ic_decode_recursive(&h->unicode_page_addresses[1],511,addressRange,c);
-    range_coder_free(c);
-    int i;
     // Convert addresses back to absolute form
     for(i=1;i<512;i++) h->unicode_page_addresses[i]+=h->rootNodeAddress-i;
   }
 
-  if (!h->unicode_pages[codePage]) {
-    // Load code page
-    h->unicode_pages[codePage]=calloc(sizeof(struct unicode_page_statistics),1);
-    range_coder *c=range_new_coder(8192);
-    int i;
-    int totalCount;
-    if (h->unicode_page_addresses[codePage]==
-	h->unicode_page_addresses[codePage+1])
-      {
-	if (0) fprintf(stderr,"WARNING: No stats for code page 0x%04x; making some up.\n",
-		       codePage*0x80);
-	for(i=0;i<128;i++) h->unicode_pages[codePage]->counts[i]=40;
-	for(i=128;i<=128+512;i++) h->unicode_pages[codePage]->counts[i]=1;
-	for(i=1;i<128+512+1;i++)
-	  h->unicode_pages[codePage]->counts[i]+=
-	    h->unicode_pages[codePage]->counts[i-1];
-	totalCount=h->unicode_pages[codePage]->counts[128+512];	
-      } else {
-      fseek(h->file,h->unicode_page_addresses[codePage],SEEK_SET);
-      fread(c->bit_stream,8192,1,h->file);
-      c->bit_stream_length=8192*8;
-      range_decode_prefetch(c);
-      totalCount=range_decode_equiprobable(c,0xffffff);
-      ic_decode_recursive(h->unicode_pages[codePage]->counts,
-			  128+512+1,totalCount+1,c);
-    }
-
-    // Rescale to fill 0-0xffffff range
-    double rescaleFactor=0xffff00*1.0/(totalCount+1);
-    if (0) fprintf(stderr,"totalCount for code page 0x%04x = %d. Rescale x%.2f\n",
-		   codePage*0x80,totalCount+1,rescaleFactor);
-    for(i=0;i<128+512+1;i++)
-      h->unicode_pages[codePage]->counts[i]*=rescaleFactor;
-  }
-  return h->unicode_pages[codePage]->counts;
+  if (h->unicode_page_addresses[codePage]==
+      h->unicode_page_addresses[codePage+1]) {
+    /* No statistics for this code page, so make some up.  They are the
+       same for every such page, so all of them share one copy. */
+    if (!h->unicodeDefaultPage) {
+      struct unicode_page_statistics *p=
+	calloc(sizeof(struct unicode_page_statistics),1);
+      if (!p) return NULL;
+      for(i=0;i<128;i++) p->counts[i]=40;
+      for(i=128;i<=128+512;i++) p->counts[i]=1;
+      for(i=1;i<128+512+1;i++) p->counts[i]+=p->counts[i-1];
+      stats_unicode_rescale(p,p->counts[128+512]);
+      h->unicodeDefaultPage=p;
+    }
+    h->unicode_pages[codePage]=h->unicodeDefaultPage;
+    return h->unicodeDefaultPage->counts;
+  }
+
+  struct unicode_page_statistics *p=
+    calloc(sizeof(struct unicode_page_statistics),1);
+  if (!p) return NULL;
+  if (stats_unicode_coder(h,h->unicode_page_addresses[codePage],c,buffer)) {
+    free(p);
+    return NULL;
+  }
+  int totalCount=range_decode_equiprobable(c,0xffffff);
+  ic_decode_recursive(p->counts,128+512+1,totalCount+1,c);
+  stats_unicode_rescale(p,totalCount);
+  h->unicode_pages[codePage]=p;
+  return p->counts;
+}
+
+/* Load the statistics for every code page now, rather than when each is
+   first used, so that the first messages in a non-Latin script are as
+   fast as the rest */
+int stats_load_unicode(stats_handle *h)
+{
+  int i;
+  for(i=1;i<512;i++) if (!getUnicodeStatistics(h,i)) return -1;
+  return 0;
 }
 
 int unicodeVectorReport(char *name,int *counts,int previousCodePage,
@@ -20,10 +20,11 @@ struct probability_vector {
   unsigned int v[CHARCOUNT];
 };
 
+/* Cumulative probability vector already worked out for a node of the
+   flattened tree.  node is one more than the index of the node, so that
+   an empty entry is zero. */
 typedef struct vector_cache {
-  char *string;
-  struct vector_cache *left,*right;
-
+  unsigned int node;
   struct probability_vector v;
 } vector_cache;
 
@@ -34,11 +35,151 @@ typedef struct node {
 
 } node;
 
+/* The context tree as stats_load_tree() keeps it: all nodes in one array,
+   with the children of each node stored together, so that a child is
+   found by counting the bits for lower symbols in childBits.  Only the
+   non-zero counts are kept, in flatCounts, and countBits says which
+   symbols they belong to.
+
+   A child adds an older character to its parent's context.  So that the
+   context can be followed as text is coded, each node also links to the
+   nodes that add a newer character to its context, in flatExt, found
+   the same way through extBits. */
+#define FLAT_BITMAP_WORDS ((CHARCOUNT+31)/32)
+struct flat_node {
+  unsigned int count;
+  unsigned int firstChild;
+  unsigned int firstCount;
+  unsigned int childBits[FLAT_BITMAP_WORDS];
+  unsigned int countBits[FLAT_BITMAP_WORDS];
+  unsigned int parent;
+  unsigned int firstExt;
+  unsigned int extBits[FLAT_BITMAP_WORDS];
+};
+
+/* Entry of the index built by stats_index_contexts().  The key packs the
+   symbols of a node's context, newest first, seven bits each and one more
+   than the symbol, so that every context has its own key and the root's
+   is zero. */
+#define CONTEXT_INDEX_MAX_ORDER 9
+struct context_index_entry {
+  unsigned long long key;
+  unsigned int node;
+};
+
+/* Node decoded by the lazy tree when a context first reaches it.  The
+   vector is worked out at the same time, and the addresses of the
+   children are kept so that the walk can carry on from here.  Entries
+   are chained from lazyHash by address, and linked from newest to
+   oldest use so that the least recently used can be evicted. */
+struct lazy_node {
+  unsigned int address;
+  unsigned int childCount;
+  unsigned int childAddresses[CHARCOUNT];
+  int hashNext;
+  int older;
+  int newer;
+  struct probability_vector v;
+};
+
+/* Block of stats.dat read by getCompressedBytes() when the file is not
+   mapped.  Each block holds STATS_BLOCK_OVERLAP bytes more than the
+   block size, so that any request of up to that many bytes can be
+   returned from the block it starts in. */
+#define STATS_BLOCK_SIZE 4096
+#define STATS_BLOCK_OVERLAP 1024
+#define STATS_BLOCK_CACHE_DEFAULT (64*1024)
+struct stats_block {
+  int block;
+  int older;
+  int newer;
+  unsigned char data[STATS_BLOCK_SIZE+STATS_BLOCK_OVERLAP];
+};
+
+/* Largest ID that stats_open_model() accepts.  A tagged message starts
+   with 0xf8 plus the ID for IDs below 7, or with 0xff and then the ID less
+   7, neither of which can start UTF-8 text or an untagged message. */
+#define STATS_MODEL_TAG 0xf8
+#define STATS_MODEL_ID_MAX (7+255)
+
+/* Vectors that a handle keeps by default, about 1MB */
+#define STATS_VECTOR_CACHE_DEFAULT 4096
+
+/* Most threads that stats_set_load_threads() will use */
+#define STATS_LOAD_THREADS_MAX 64
+
+/* Levels for stats_set_level(), from quickest to slowest to encode.  They
+   are named for what they do rather than how well they compress, as
+   whether a shorter context codes a message in fewer bits depends on the
+   model and the text. */
+#define STATS_LEVEL_CONTEXT_LESS_3 1
+#define STATS_LEVEL_CONTEXT_LESS_2 2
+#define STATS_LEVEL_MODEL_ONLY 3
+#define STATS_LEVEL_DEFAULT 4
+
+/* A message coded with contexts n characters shorter than the model's
+   order starts with 0xf0 plus n, for n from 1 to 7.  An untagged message
+   otherwise starts below 0xc0, and model tags start at 0xf8. */
+#define STATS_CONTEXT_TAG 0xf0
+
 struct unicode_page_statistics {
   // Counts of each of the 128 characters
   // plus counts of transitions to the 512 possible code pages
   // plus count of transitions back to the previously used code page
   int counts[128+512+1];
+  /* Speeds up decoding of characters and code page switches */
+  struct range_frequency_index index;
+};
+
+/* A snapshot (stats.bin) holds the model already decoded from stats.dat,
+   laid out so that it can be mapped read-only and used in place: this
+   header, then the flattened tree, its counts, the vector for every node,
+   and the unicode page statistics, each found by its offset from the
+   start of the file.  Values are in the byte order of the machine that
+   wrote the snapshot, and byteOrder, charCount and the structure sizes
+   must match for it to be used. */
+#define STATS_SNAPSHOT_MAGIC "STB2"
+#define STATS_SNAPSHOT_BYTE_ORDER 0x01020304
+struct stats_snapshot_header {
+  char magic[4];
+  unsigned int byteOrder;
+  unsigned int charCount;
+  unsigned int headerSize;
+  unsigned int flatNodeSize;
+  unsigned int fileLength;
+
+  unsigned int totalCount;
+  unsigned int maximumOrder;
+  unsigned int casestartofmessage[1][1];
+  unsigned int casestartofword2[2][1];
+  unsigned int casestartofword3[2][2][1];
+  unsigned int caseposn1[80][1];
+  unsigned int caseposn2[2][80][1];
+  int messagelengths[1024];
+  struct range_frequency_index messagelengths_index;
+
+  unsigned int flatNodeCount;
+  unsigned int flatCountCount;
+  unsigned int flatExtCount;
+  unsigned int flatOffset;
+  unsigned int flatCountsOffset;
+  unsigned int flatExtOffset;
+  unsigned int vectorsOffset;
+  /* Statistics for each code page.  Pages without statistics of their
+     own share one table. */
+  unsigned int unicodePageOffsets[512];
+};
+
+/* Where the decoded tables of a model are, whether in a snapshot or
+   compiled into the program by `smac compile'.  The offsets in the
+   header are not used. */
+struct stats_tables {
+  const struct stats_snapshot_header *header;
+  const struct flat_node *flat;
+  const unsigned int *flatCounts;
+  const unsigned int *flatExt;
+  const struct probability_vector *vectors;
+  const struct unicode_page_statistics *unicodePages[512];
 };
 
 typedef struct compressed_stats_handle {
@@ -46,14 +187,42 @@ typedef struct compressed_stats_handle {
   unsigned char *mmap;
   int fileLength;
   int dummyOffset;
+  /* Set if the model is a snapshot, compiled in, or shared with other
+     threads, in which case the flattened tree, vectors and unicode pages
+     are not this handle's to free */
+  int sharedTables;
   unsigned char *buffer;
-  unsigned char *bufferBitmap;  
+
+  /* Cache of blocks of the file, used when it is not mapped.  blockSlots
+     gives the entry in blocks holding each block of the file, or -1, and
+     entries are linked from most to least recently used. */
+  int blockCacheBytes;
+  struct stats_block *blocks;
+  int blockCount;
+  int blocksUsed;
+  int *blockSlots;
+  int blockNewest;
+  int blockOldest;
 
   unsigned int rootNodeAddress;
   unsigned int totalCount;
   unsigned int unicodeAddress;
   unsigned int maximumOrder;
 
+  /* Trade compression for speed, as set by stats_set_level().  Contexts
+     are limited to the newest maximumContext characters if it is
+     non-zero, which is contextShortening less than the model's order.
+     That changes the coded bits, so stats3_compress() records it in the
+     message.  noPackedASCIITrial only stops the encoder from trying
+     packed ASCII as well. */
+  unsigned int maximumContext;
+  int contextShortening;
+  int noPackedASCIITrial;
+
+  /* ID written by stats3_compress_tagged(), or -1, as given to
+     stats_open_model() */
+  int modelId;
+
   /* Basic model statistics that are required.
      These are preloaded when a stats_handle is created.
      Total size of these is about 5KB, so no big problem,
@@ -64,25 +233,77 @@ typedef struct compressed_stats_handle {
   unsigned int caseposn1[80][1];
   unsigned int caseposn2[2][80][1];
   int messagelengths[1024];
+  /* Speeds up decoding of message lengths */
+  struct range_frequency_index messagelengths_index;
 
-  /* Full extracted tree */
+  /* Full extracted tree, only used while it is being flattened */
   struct node *tree;
+  /* Threads to decode it with */
+  int loadThreads;
+  /* Flattened tree */
+  struct flat_node *flat;
+  unsigned int *flatCounts;
+  int flatNodeCount;
+  int flatCountCount;
+  /* If quantisedBits is set, the counts are instead kept in flatQuantised,
+     in that many bits each */
+  int quantisedBits;
+  void *flatQuantised;
+  /* Links to newer contexts, or NULL if they cannot be followed */
+  unsigned int *flatExt;
+  int flatExtCount;
+  /* Hash table of nodes by context, or NULL.  It is shared by thread
+     handles, which set contextIndexShared. */
+  struct context_index_entry *contextIndex;
+  int contextIndexBits;
+  int contextIndexShared;
+  /* Node returned by extractNode() when the tree is flattened */
+  struct node node;
+
+  /* Nodes decoded on demand, when the tree is not preloaded */
+  struct lazy_node *lazyNodes;
+  int lazyNodeCount;
+  int lazyNodesUsed;
+  int *lazyHash;
+  int lazyHashBits;
+  int lazyNewest;
+  int lazyOldest;
 
-  /* Unicode statistics */
+  /* Unicode statistics.  Pages without statistics of their own all
+     point to unicodeDefaultPage. */
   struct unicode_page_statistics *unicode_pages[512];
+  struct unicode_page_statistics *unicodeDefaultPage;
   int *unicode_page_addresses;
 
+  /* Vector for every node of the flattened tree, from a snapshot */
+  struct probability_vector *vectors;
+
   /* Used when not caching vectors for returning vector values */
   struct probability_vector vector;
+
+  /* Vectors for nodes of the flattened tree, indexed by node number
+     modulo vectorCacheSize.  vectorCacheLimit is the most entries to
+     allocate, or -1 for one per node.  Thread handles each have their
+     own, so it defaults to STATS_VECTOR_CACHE_DEFAULT entries. */
+  vector_cache *vectorCache;
+  int vectorCacheSize;
+  int vectorCacheLimit;
 } stats_handle;
 
 void node_free(struct node *n);
 struct node *extractNode(unsigned short *string,int len,stats_handle *h);
+struct flat_node *extractFlatNode(unsigned short *string,int len,
+				  stats_handle *h);
+unsigned int indexedFlatNode(unsigned short *string,int len,stats_handle *h);
 struct node *extractNodeAt(unsigned short *s,int len,unsigned int nodeAddress,
 			   int count,
 			   stats_handle *h,int extractAllP,int debugP);
 struct probability_vector *extractVector(unsigned short *string,int len,
 					 stats_handle *h);
+struct probability_vector *contextVector(stats_handle *h,unsigned int node);
+unsigned int contextNext(stats_handle *h,unsigned int node,unsigned short c);
+unsigned int contextTruncate(stats_handle *h,unsigned int node,
+			     unsigned int length);
 double entropyOfSymbol(struct probability_vector *v,int s);
 int vectorReportShort(char *name,struct probability_vector *v,int s);
 int vectorReport(char *name,struct probability_vector *v,int s);
@@ -91,7 +312,30 @@ int dumpNode(struct node *n);
 void stats_handle_free(stats_handle *h);
 stats_handle *stats_new_handle(char *file);
 int stats_load_tree(stats_handle *h);
+int stats_set_load_threads(stats_handle *h,int threads);
+int stats_set_quantised_counts(stats_handle *h,int bits);
+int stats_set_level(stats_handle *h,int level);
+int stats_shorten_context(stats_handle *h,int shorter);
+int stats_set_vector_cache(stats_handle *h,int entries);
+int stats_set_block_cache(stats_handle *h,int bytes);
+int stats_lazy_tree(stats_handle *h,int cacheBytes);
+int stats_index_contexts(stats_handle *h);
+int stats_write_snapshot(stats_handle *h,char *file);
+int stats_write_tables_c(stats_handle *h,char *file,char *name);
+int stats_use_tables(stats_handle *h,const struct stats_tables *t);
+stats_handle *stats_compiled_handle(const struct stats_tables *t);
+stats_handle *stats_thread_handle(stats_handle *model);
+stats_handle *stats_open(char *file);
+stats_handle *stats_open_model(char *file,int modelId);
+int stats_close(stats_handle *h);
+stats_handle *stats_thread_model(int modelId);
+int stats_flush_models();
+int decodeNodeAt(stats_handle *h,unsigned int nodeAddress,int count,
+		 unsigned int *totalCount,unsigned int counts[CHARCOUNT],
+		 unsigned int *childCount,
+		 unsigned int childAddresses[CHARCOUNT],int debug);
 unsigned char *getCompressedBytes(stats_handle *h,int start,int count);
 int *getUnicodeStatistics(stats_handle *h,int codePage);
+int stats_load_unicode(stats_handle *h);
 int unicodeVectorReport(char *name,int *counts,int previousCodePage,
 			int codePage,unsigned short s);
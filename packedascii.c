@@ -45,6 +45,7 @@ int decodePackedASCII(range_coder *c, unsigned char *m,int encodedLength)
   int i;
   for(i=0;i<encodedLength;i++) {
     int symbol=range_decode_equiprobable(c,PRINTABLECHARCOUNT);
+    if (symbol<0) return -1;
     int character=printableChars[symbol];
     m[i]=character;
   }
@@ -400,7 +400,7 @@ int recipe_decode_field(struct recipe *recipe,stats_handle *stats, range_coder *
     if (normalised_value==(maximum-minimum+1)) {
       // out of range value, so decode it as a string.
       fprintf(stderr,"FIELDTYPE_INTEGER: Illegal value - decoding string representation.\n");
-      stats3_decompress_bits(c,(unsigned char *)value,&value_size,stats,NULL);
+      return stats3_decompress_bits(c,(unsigned char *)value,&value_size,stats,NULL);
     } else 
       sprintf(value,"%d",normalised_value+minimum);
     return 0;
@@ -462,8 +462,7 @@ int recipe_decode_field(struct recipe *recipe,stats_handle *stats, range_coder *
     return 0;
     break;
   case FIELDTYPE_TEXT:
-    stats3_decompress_bits(c,(unsigned char *)value,&value_size,stats,NULL);
-    return 0;
+    return stats3_decompress_bits(c,(unsigned char *)value,&value_size,stats,NULL);
   case FIELDTYPE_TIMEDATE:
     // time is 32-bit seconds since 1970.
     // Format as yyyy-mm-ddThh:mm:ss+hh:mm
@@ -964,18 +963,20 @@ int recipe_decompress(stats_handle *h, char *recipe_dir,
     return -1;
   }
 
-  // Make new range coder with 1KB of space
-  range_coder *c=range_new_coder(1024);
-
   // Point range coder bit stream to input buffer
-  bcopy(in,c->bit_stream,in_len);
-  c->bit_stream_length=in_len*8;
+  range_coder coder,*c=&coder;
+  range_coder_init(c,in,in_len);
   range_decode_prefetch(c);
   
   // Read form id hash from the succinct data stream.
   unsigned char formhash[6];
   int i;
   for(i=0;i<6;i++) formhash[i]=range_decode_equiprobable(c,256);
+  if (c->errors) {
+    snprintf(recipe_error,2048,"Corrupt message.\n");
+    LOGI("%s:%d: %s",__FILE__,__LINE__,recipe_error);
+    return -1;
+  }
   printf("formhash from succinct data message = %02x%02x%02x%02x%02x%02x\n",
 	 formhash[0],formhash[1],formhash[2],
 	 formhash[3],formhash[4],formhash[5]);
@@ -985,7 +986,6 @@ int recipe_decompress(stats_handle *h, char *recipe_dir,
   if (!recipe) {
     snprintf(recipe_error,2048,"No recipe provided.\n");
     LOGI("%s:%d: %s",__FILE__,__LINE__,recipe_error);
-    range_coder_free(c);
     return -1;
   }
   snprintf(recipe_name,1024,"%s",recipe->formname);
@@ -995,14 +995,20 @@ int recipe_decompress(stats_handle *h, char *recipe_dir,
   for(field=0;field<recipe->field_count;field++)
     {
       int field_present=range_decode_equiprobable(c,2);
+      if (field_present<0) {
+	snprintf(recipe_error,2048,"Corrupt message.\n");
+	return -1;
+      }
       printf("%sdecompressing value for '%s'\n",
 	     field_present?"":"not ",
 	     recipe->fields[field].name);
       if (field_present) {
 	char value[1024];
 	int r=recipe_decode_field(recipe,h,c,field,value,1024);
-	if (r) {
-	  range_coder_free(c);
+	/* Most field types do not check every decoded value, but any
+	   failure is counted in c->errors */
+	if (r||c->errors) {
+	  if (!r) snprintf(recipe_error,2048,"Corrupt message.\n");
 	  return -1;
 	}
 	printf("  the value is '%s'\n",value);
@@ -1020,8 +1026,6 @@ int recipe_decompress(stats_handle *h, char *recipe_dir,
 	if (r2>0) written+=r2;	
       }
     }
-  
-  range_coder_free(c);
 
   return written;
 }
@@ -1054,11 +1058,10 @@ int recipe_compress(stats_handle *h,struct recipe *recipe,
   }
 
   // Make new range coder with 1KB of space
-  range_coder *c=range_new_coder(1024);
-  if (!c) {
-    snprintf(recipe_error,2048,"Could not instantiate range coder.\n");
-    return -1;
-  }
+  unsigned char bits[1024];
+  range_coder coder,*c=&coder;
+  range_coder_init(c,bits,sizeof(bits));
+  c->noentropy=1;
 
   // Write form hash first
   int i;
@@ -1134,7 +1137,6 @@ int recipe_compress(stats_handle *h,struct recipe *recipe,
       // Now, based on type of field, encode it.
       if (recipe_encode_field(recipe,h,c,field,values[i]))
 	{
-	  range_coder_free(c);
 	  snprintf(recipe_error,2048,"Could not record value '%s' for field '%s' (type %d)\n",
 		   values[i],recipe->fields[field].name,
 		   recipe->fields[field].type);
@@ -1153,13 +1155,11 @@ int recipe_compress(stats_handle *h,struct recipe *recipe,
   range_conclude(c);
   int bytes=(c->bits_used/8)+((c->bits_used&7)?1:0);
   if (bytes>out_size) {
-    range_coder_free(c);
     snprintf(recipe_error,2048,"Compressed data too big for output buffer\n");
     return -1;
   }
   
   bcopy(c->bit_stream,out,bytes);
-  range_coder_free(c);
 
   printf("Used %d bits (%d bytes).\n",c->bits_used,bytes);
 
@@ -54,6 +54,11 @@ struct recipe {
 int recipe_main(int argc,char *argv[],stats_handle *h);
 struct recipe *recipe_read_from_file(char *filename);
 struct recipe *recipe_read(char *formname,char *buffer,int buffer_size);
+int recipe_compress(stats_handle *h,struct recipe *recipe,
+		    char *in,int in_len,unsigned char *out,int out_size);
+int recipe_decompress(stats_handle *h,char *recipe_dir,
+		      unsigned char *in,int in_len,char *out,int out_size,
+		      char *recipe_name);
 int stripped2xml(char *stripped,int stripped_len,char *template,int template_len,char *xml,int xml_size);
 int xml2stripped(const char *form_name, const char *xml,int xml_len,char *stripped,int stripped_size);
 
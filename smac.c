@@ -71,6 +71,7 @@ int stats3_decompress_bits(range_coder *c,unsigned char m[1025],int *len_out,
   /* Check if message is encoded naturally */
   int b7=range_decode_equiprobable(c,2);
   int b6=range_decode_equiprobable(c,2);
+  if (b7<0||b6<0) return -1;
   int notRawASCII=0;
   if (b7&&(!b6)) notRawASCII=1;
   if (notRawASCII==0) {
@@ -81,15 +82,15 @@ int stats3_decompress_bits(range_coder *c,unsigned char m[1025],int *len_out,
     */
     
     // Reconstitute first byte
-    unsigned char b5to0 = range_decode_equiprobable(c,64);
+    int b5to0 = range_decode_equiprobable(c,64);
+    if (b5to0<0) return -1;
     b5to0|=(b6<<6);
     b5to0|=(b7<<7);
     m[0]=b5to0;
     // printf("Read byte 0x%02x\n",m[0]);
 
-    // Also stop decoding if there are too many bytes (2K should be a reasonable
-    // limit).
-    for(i=1;m[i-1]&&(i<2048);i++) {
+    // Also stop decoding if there are too many bytes for m[].
+    for(i=1;m[i-1]&&(i<1024);i++) {
       int r=range_decode_equiprobable(c,256);
       // printf("Read byte 0x%02x\n",r);
       // ... or if we hit the end of the compressed bit stream.
@@ -102,15 +103,18 @@ int stats3_decompress_bits(range_coder *c,unsigned char m[1025],int *len_out,
   }
   
   int notPackedASCII=range_decode_symbol(c,&probPackedASCII,2);
+  if (notPackedASCII<0) return -1;
 
-  int encodedLength=range_decode_symbol(c,(unsigned int *)h->messagelengths,1024);
+  int encodedLength=range_decode_symbol_indexed(c,(unsigned int *)h->messagelengths,
+					       1024,&h->messagelengths_index);
+  if (encodedLength<0) return -1;
   for(i=0;i<encodedLength;i++) m[i]='?'; 
   m[i]=0;
 
   if (notPackedASCII==0) {
     /* packed ASCII -- copy from input to output */
     // printf("decoding packed ASCII\n");
-    decodePackedASCII(c,m,encodedLength);
+    if (decodePackedASCII(c,m,encodedLength)) return -1;
     *len_out=encodedLength;
     return 0;
   }
@@ -119,7 +123,8 @@ int stats3_decompress_bits(range_coder *c,unsigned char m[1025],int *len_out,
   int nonAlphaPositions[1024];
   int nonAlphaCount=0;
 
-  decodeNonAlpha(c,nonAlphaPositions,nonAlphaValues,&nonAlphaCount,encodedLength);
+  if (decodeNonAlpha(c,nonAlphaPositions,nonAlphaValues,&nonAlphaCount,
+		     encodedLength)) return -1;
 
   int alphaCount=encodedLength-nonAlphaCount;
 
@@ -127,9 +132,10 @@ int stats3_decompress_bits(range_coder *c,unsigned char m[1025],int *len_out,
 
   unsigned short lowerCaseAlphaChars[1025];
 
-  decodeLCAlphaSpace(c,lowerCaseAlphaChars,alphaCount,h,entropyLog);
+  if (decodeLCAlphaSpace(c,lowerCaseAlphaChars,alphaCount,h,entropyLog))
+    return -1;
 
-  decodeCaseModel1(c,lowerCaseAlphaChars,alphaCount,h);
+  if (decodeCaseModel1(c,lowerCaseAlphaChars,alphaCount,h)) return -1;
   mungeCase(lowerCaseAlphaChars,alphaCount);
   
   /* reintegrate alpha and non-alpha characters */
@@ -145,7 +151,7 @@ int stats3_decompress_bits(range_coder *c,unsigned char m[1025],int *len_out,
 	m16[i]=lowerCaseAlphaChars[alphaPointer++];
       }
     }
-  utf16toutf8(m16,i,m,len_out);
+  if (utf16toutf8(m16,i,m,len_out)) return -1;
   m[*len_out]=0;
   //  fprintf(stderr,"m='%s', len=%d\n",m,*len_out);
 
@@ -155,22 +161,25 @@ int stats3_decompress_bits(range_coder *c,unsigned char m[1025],int *len_out,
 int stats3_decompress(unsigned char *in,int inlen,unsigned char *out, int *outlen,
 		      stats_handle *h)
 {
-  range_coder *c=range_new_coder(inlen*2);
-  bcopy(in,c->bit_stream,inlen);
-
-  c->bit_stream_length=inlen*8;
-  c->bits_used=0;
-  c->low=0;
-  c->high=0xffffffff;
-  range_decode_prefetch(c);
-
-  if (stats3_decompress_bits(c,out,outlen,h,NULL)) {
-    range_coder_free(c);
-    return -1;
+  /* Decode with the contexts that the message was coded with, which it
+     records if they were shortened, and then put back the handle's own */
+  int shorter=0,handleShorter=h->contextShortening;
+  if (inlen>0&&in[0]>STATS_CONTEXT_TAG&&in[0]<STATS_MODEL_TAG) {
+    shorter=in[0]-STATS_CONTEXT_TAG;
+    in++;
+    inlen--;
   }
+  if (shorter!=handleShorter) stats_shorten_context(h,shorter);
 
-  range_coder_free(c);
-  return 0;
+  /* The decoder only reads the bit stream, so can work directly on the
+     input */
+  range_coder c;
+  range_coder_init(&c,in,inlen);
+  range_decode_prefetch(&c);
+
+  int r=stats3_decompress_bits(&c,out,outlen,h,NULL);
+  if (shorter!=handleShorter) stats_shorten_context(h,handleShorter);
+  return r;
 }
 
 int stats3_compress_radix_append(range_coder *c,unsigned char *m_in,int m_in_len,
@@ -273,30 +282,42 @@ int stats3_compress_uncompressed_append(range_coder *c,unsigned char *m_in,int m
 int stats3_compress_append(range_coder *c,unsigned char *m_in,int m_in_len,
 			   stats_handle *h,double *entropyLog)
 {
-  int b1,b2,b3;
+  int b1,b2;
 
-  /* Try the three sub-models to see which performs best. */
-
-  // Variable depth model
-  range_coder *t1=range_new_coder(1024);
-  stats3_compress_model1_append(t1,m_in,m_in_len,h,entropyLog);
-  range_conclude(t1); b1=t1->bits_used; range_coder_free(t1);
+  /* Try the sub-models from the same starting point, and keep the bits of
+     whichever performs best, rather than encoding it a second time. */
+  range_coder start,radix;
+  unsigned char radix_bits[2048];
+  int radix_bytes=0;
+  range_coder_checkpoint(c,&start);
 
   // Packed ascii (only if there are no non-ascii chars)
-  range_coder *t2=range_new_coder(1024);
-  if (stats3_compress_radix_append(t2,m_in,m_in_len,h,entropyLog)) 
-    b2=999999;
-  else { range_conclude(t2); b2=t2->bits_used; }
-  range_coder_free(t2);
+  b2=999999;
+  if (!h->noPackedASCIITrial
+      &&!stats3_compress_radix_append(c,m_in,m_in_len,h,entropyLog)) {
+    radix_bytes=range_coder_save_since(c,&start,radix_bits,sizeof(radix_bits));
+    if (radix_bytes>=0) {
+      b2=range_conclude_bits(c);
+      if (b2<0) b2=999999;
+      range_coder_checkpoint(c,&radix);
+    }
+  }
+  range_coder_restore(c,&start);
 
-  // Unpacked (only if the first character <= 127)
-  b3=(m_in_len+1)*8; // one extra character for null termination
-  b3=999999;
+  // Variable depth model
+  if (stats3_compress_model1_append(c,m_in,m_in_len,h,entropyLog)) return -1;
+  b1=range_conclude_bits(c);
+  if (b1<0) b1=999999;
 
-  // Compare the results and encode accordingly
-  if (b1<b2&&b1<b3)
-    return stats3_compress_model1_append(c,m_in,m_in_len,h,entropyLog);
-  else if (b2<b3||(m_in[0]&0x80))
+  // Unpacked (only if the first character <= 127)
+  // b3=(m_in_len+1)*8; // one extra character for null termination
+
+  // Compare the results, and put back the winner if it isn't already there
+  if (b1<b2) return 0;
+  if (b2<999999)
+    return range_coder_restore_saved(c,&radix,radix_bits,radix_bytes);
+  range_coder_restore(c,&start);
+  if (m_in[0]&0x80)
     return stats3_compress_radix_append(c,m_in,m_in_len,h,entropyLog);
   else
     return stats3_compress_uncompressed_append(c,m_in,m_in_len,h,entropyLog);
@@ -316,15 +337,275 @@ int stats3_compress_bits(range_coder *c,unsigned char *m_in,int m_in_len,
 
 int stats3_compress(unsigned char *in,int inlen,unsigned char *out, int *outlen,stats_handle *h)
 {
-  range_coder *c=range_new_coder(inlen*2);
-  if (stats3_compress_bits(c,in,inlen,h,NULL)) {
-    range_coder_free(c);
+  /* Allow for up to twice the length of the input.  Messages are limited
+     to 1024 bytes, so this fits comfortably on the stack. */
+  unsigned char bits[2048];
+  range_coder c;
+  range_coder_init(&c,bits,(inlen*2<sizeof(bits))?inlen*2:sizeof(bits));
+  c.noentropy=1;
+  if (stats3_compress_bits(&c,in,inlen,h,NULL)) return -1;
+  range_conclude(&c);
+
+  /* Shortened contexts cost a byte to record, so that the message
+     decodes at any level */
+  int headerBytes=0;
+  if (h->contextShortening)
+    out[headerBytes++]=STATS_CONTEXT_TAG+h->contextShortening;
+  *outlen=c.bits_used>>3;
+  if (c.bits_used&7) (*outlen)++;
+  bcopy(c.bit_stream,out+headerBytes,*outlen);
+  *outlen+=headerBytes;
+  return 0;
+}
+
+/* Compress a message, starting it with the ID of the model, as given to
+   stats_open_model(), so that stats3_decompress_tagged() can pick the
+   model to decode it with.  This costs one byte, or two for IDs of 7 or
+   more. */
+int stats3_compress_tagged(unsigned char *in,int inlen,unsigned char *out,
+			   int *outlen,stats_handle *h)
+{
+  int tagBytes=1;
+
+  if (h->modelId<0) {
+    fprintf(stderr,"Model has no ID to tag messages with.\n");
     return -1;
   }
-  range_conclude(c);
-  *outlen=c->bits_used>>3;
-  if (c->bits_used&7) (*outlen)++;
-  bcopy(c->bit_stream,out,*outlen);
-  range_coder_free(c);
+  if (h->modelId<7) out[0]=STATS_MODEL_TAG+h->modelId;
+  else {
+    out[0]=0xff;
+    out[1]=h->modelId-7;
+    tagBytes=2;
+  }
+  if (stats3_compress(in,inlen,out+tagBytes,outlen,h)) return -1;
+  *outlen+=tagBytes;
+  return 0;
+}
+
+/* Decompress a message from stats3_compress_tagged() with the open model
+   that it names, or an untagged message with h, which may be NULL if
+   only tagged messages are expected.  Tagged messages are decoded with
+   the calling thread's own handle for the model, so any number of
+   threads can decode them at once. */
+int stats3_decompress_tagged(unsigned char *in,int inlen,unsigned char *out,
+			     int *outlen,stats_handle *h)
+{
+  if (inlen>0&&in[0]>=STATS_MODEL_TAG) {
+    int modelId=in[0]-STATS_MODEL_TAG;
+    int tagBytes=1;
+    if (in[0]==0xff) {
+      if (inlen<2) return -1;
+      modelId=7+in[1];
+      tagBytes=2;
+    }
+    h=stats_thread_model(modelId);
+    if (!h) {
+      fprintf(stderr,"Message is for model %d, which is not open.\n",modelId);
+      return -1;
+    }
+    in+=tagBytes;
+    inlen-=tagBytes;
+  }
+  if (!h) {
+    fprintf(stderr,"Message does not say which model to decode it with.\n");
+    return -1;
+  }
+  return stats3_decompress(in,inlen,out,outlen,h);
+}
+
+#ifdef TESTMODE
+/* Checks that compressing and decompressing a message makes no heap
+   allocations once the model is loaded.  The test binary is linked with
+   --wrap for the allocation functions, so that every call from our code
+   passes through the counters below. */
+#include <string.h>
+#include <fcntl.h>
+#include "recipe.h"
+
+__thread long long total_alpha_bits=0;
+__thread long long total_nonalpha_bits=0;
+__thread long long total_case_bits=0;
+__thread long long total_model_bits=0;
+__thread long long total_length_bits=0;
+__thread long long total_finalisation_bits=0;
+__thread long long total_unicode_millibits=0;
+__thread long long total_unicode_chars=0;
+
+int allocations=0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb,size_t size);
+void *__real_realloc(void *ptr,size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+  allocations++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb,size_t size)
+{
+  allocations++;
+  return __real_calloc(nmemb,size);
+}
+
+void *__wrap_realloc(void *ptr,size_t size)
+{
+  allocations++;
+  return __real_realloc(ptr,size);
+}
+
+int main(int argc,char **argv)
+{
+  char *messages[]={
+    "Hello world",
+    "Meet me at the station at 10:30, and bring 2 umbrellas!",
+    "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG",
+    "http://www.servalproject.org/",
+    "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 world",
+    NULL};
+  stats_handle *h=stats_new_handle(argc>1?argv[1]:"stats.dat");
+  if (!h) {
+    fprintf(stderr,"Could not load stats file.\n");
+    exit(-1);
+  }
+  /* The lazy tree has a fixed size cache, so must not allocate either */
+  if (getenv("SMAC_LAZY_TREE"))
+    stats_lazy_tree(h,atoi(getenv("SMAC_LAZY_TREE")));
+  else
+    stats_load_tree(h);
+
+  printf("Counting heap allocations per message.\n");
+
+  /* The first pass may load parts of the model on demand, e.g., unicode
+     code page statistics, so only the second pass has to be clean. */
+  int pass,i;
+  for(pass=0;pass<2;pass++) {
+    int before=allocations;
+    for(i=0;messages[i];i++) {
+      unsigned char out[1025],in[1025];
+      int outlen,inlen;
+      if (stats3_compress((unsigned char *)messages[i],strlen(messages[i]),
+			  out,&outlen,h)) {
+	fprintf(stderr,"Could not compress '%s'\n",messages[i]);
+	exit(-1);
+      }
+      if (stats3_decompress(out,outlen,in,&inlen,h)
+	  ||inlen!=strlen(messages[i])||memcmp(in,messages[i],inlen)) {
+	fprintf(stderr,"Could not decompress '%s'\n",messages[i]);
+	exit(-1);
+      }
+    }
+    printf("  pass %d: %d allocations for %d messages\n",
+	   pass+1,allocations-before,i);
+    if (pass&&allocations!=before) {
+      fprintf(stderr,"Compressing and decompressing allocated memory.\n");
+      exit(-1);
+    }
+  }
+
+  /* A tagged message finds its model in the registry by itself.  ID 9
+     takes the two byte tag. */
+  stats_handle *model=stats_open_model(argc>1?argv[1]:"stats.dat",9);
+  unsigned char out[1025],in[1025];
+  int outlen,inlen;
+  if (!model||stats_open(argc>1?argv[1]:"stats.dat")!=model
+      ||stats3_compress_tagged((unsigned char *)messages[1],
+			       strlen(messages[1]),out,&outlen,model)
+      ||stats3_decompress_tagged(out,outlen,in,&inlen,NULL)
+      ||inlen!=strlen(messages[1])||memcmp(in,messages[1],inlen)) {
+    fprintf(stderr,"Could not decompress tagged message.\n");
+    exit(-1);
+  }
+
+  /* A message coded with shortened contexts says so, and decodes with a
+     handle at the default level, tagged or not */
+  if (stats_set_level(h,STATS_LEVEL_CONTEXT_LESS_3)
+      ||stats3_compress((unsigned char *)messages[1],strlen(messages[1]),
+			out,&outlen,h)
+      ||stats_set_level(h,STATS_LEVEL_DEFAULT)
+      ||stats3_decompress(out,outlen,in,&inlen,h)
+      ||inlen!=strlen(messages[1])||memcmp(in,messages[1],inlen)
+      ||stats_set_level(model,STATS_LEVEL_CONTEXT_LESS_2)
+      ||stats3_compress_tagged((unsigned char *)messages[1],
+			       strlen(messages[1]),out,&outlen,model)
+      ||stats_set_level(model,STATS_LEVEL_DEFAULT)
+      ||stats3_decompress_tagged(out,outlen,in,&inlen,NULL)
+      ||inlen!=strlen(messages[1])||memcmp(in,messages[1],inlen)) {
+    fprintf(stderr,"Could not decompress message with shortened contexts.\n");
+    exit(-1);
+  }
+  printf("   -- passed.\n");
+
+  /* The context index must find the same node as walking down the tree,
+     at every position of every message.  The lazy tree has neither. */
+  if (h->flat) {
+    printf("Comparing the context index with the tree.\n");
+    if (stats_index_contexts(h)) {
+      fprintf(stderr,"Could not index contexts.\n");
+      exit(-1);
+    }
+    for(i=0;messages[i];i++) {
+      unsigned short utf16[1025];
+      int len,p;
+      utf8toutf16((unsigned char *)messages[i],strlen(messages[i]),utf16,&len);
+      for(p=1;p<=len;p++)
+	if (indexedFlatNode(utf16,p,h)!=extractFlatNode(utf16,p,h)-h->flat) {
+	  fprintf(stderr,"Index and tree disagree at character %d of '%s'\n",
+		  p,messages[i]);
+	  exit(-1);
+	}
+    }
+    printf("   -- passed.\n");
+  }
+
+  /* Truncated or damaged recipe messages must either decode or fail with
+     -1, and never crash.  The damage is every single bit flipped in turn
+     after the form hash, so that it reaches the text fields, which leave
+     the coder in a state that depends on the model. */
+  char *recipe_dir=argc>2?argv[2]:".";
+  char recipe_file[1024];
+  snprintf(recipe_file,1024,"%s/nzrc.recipe",recipe_dir);
+  struct recipe *recipe=recipe_read_from_file(recipe_file);
+  if (!recipe) {
+    fprintf(stderr,"Could not read %s\n",recipe_file);
+    exit(-1);
+  }
+  char *record="street_number=15\naddress=Northumberland, NEV\n"
+    "head_of_household=Harrington\ncasualties.trapped=2\n";
+  unsigned char succinct[1024],damaged[1024];
+  char decoded[4096],recipe_name[1024];
+  printf("Decoding truncated and corrupt recipe messages.\n");
+  fflush(stdout);
+  /* The recipe code reports its progress, so keep that quiet */
+  int saved_stdout=dup(1),saved_stderr=dup(2),devnull=open("/dev/null",O_WRONLY);
+  dup2(devnull,1);
+  dup2(devnull,2);
+  int succinct_len=recipe_compress(model,recipe,record,strlen(record),
+				   succinct,sizeof(succinct));
+  int failed=succinct_len<6?-2:0;
+  for(i=0;i<=succinct_len&&!failed;i++) {
+    /* Fewer than 6 bytes cannot hold the 48 bits of the form hash */
+    int r=recipe_decompress(model,recipe_dir,succinct,i,decoded,
+			    sizeof(decoded),recipe_name);
+    if ((i<6&&r!=-1)||r<-1) failed=i+1;
+  }
+  for(i=6*8;i<succinct_len*8&&!failed;i++) {
+    bcopy(succinct,damaged,succinct_len);
+    damaged[i>>3]^=0x80>>(i&7);
+    if (recipe_decompress(model,recipe_dir,damaged,succinct_len,decoded,
+			  sizeof(decoded),recipe_name)<-1)
+      failed=-1-i;
+  }
+  fflush(stdout);
+  dup2(saved_stdout,1);
+  dup2(saved_stderr,2);
+  close(devnull);
+  if (failed) {
+    fprintf(stderr,"Decoding corrupt recipe message failed (%d).\n",failed);
+    exit(-1);
+  }
+  printf("   -- passed.\n");
   return 0;
 }
+#endif
@@ -16,12 +16,14 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
-extern long long total_alpha_bits;
-extern long long total_nonalpha_bits;
-extern long long total_case_bits;
-extern long long total_model_bits;
-extern long long total_length_bits;
-extern long long total_finalisation_bits;
+/* Entropy used by each part of the model, for reporting.  These are per
+   thread, so that threads can compress at the same time. */
+extern __thread long long total_alpha_bits;
+extern __thread long long total_nonalpha_bits;
+extern __thread long long total_case_bits;
+extern __thread long long total_model_bits;
+extern __thread long long total_length_bits;
+extern __thread long long total_finalisation_bits;
 
 int stats3_compress(unsigned char *in,int inlen,unsigned char *out, int *outlen,
 		    stats_handle *h);
@@ -34,3 +36,7 @@ int stats3_decompress(unsigned char *in,int inlen,unsigned char *out, int *outle
 int stats3_decompress_bits(range_coder *c,unsigned char m[1025],int *len_out,
 			   stats_handle *h,double *entropyLog);
 
+int stats3_compress_tagged(unsigned char *in,int inlen,unsigned char *out,
+			   int *outlen,stats_handle *h);
+int stats3_decompress_tagged(unsigned char *in,int inlen,unsigned char *out,
+			     int *outlen,stats_handle *h);